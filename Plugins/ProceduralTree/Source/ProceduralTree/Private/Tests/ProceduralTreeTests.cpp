@@ -0,0 +1,82 @@
+// Copyright 2018 Elhoussine Mehnik (Mhousse1247). All Rights Reserved.
+//******************* http://ue4resources.com/ *********************//
+
+#include "Misc/AutomationTest.h"
+
+#include "proctree.h"
+
+#if WITH_DEV_AUTOMATION_TESTS
+
+IMPLEMENT_SIMPLE_AUTOMATION_TEST(FProceduralTreeIndex16Test, "ProceduralTree.Index16Ranges", EAutomationTestFlags::EditorContext | EAutomationTestFlags::EngineFilter)
+
+bool FProceduralTreeIndex16Test::RunTest(const FString& Parameters)
+{
+	// Without vertex cache ordering the seam vertices of this tree end up far
+	// from the faces that use them, so the ranges need their own vertex copies
+	Proctree::Tree Tree;
+	Tree.mProperties.mSegments = 64;
+	Tree.mProperties.mLevels = 7;
+	Tree.mProperties.mTreeSteps = 10;
+	Tree.mProperties.mOptimizeVertexCache = false;
+	const Proctree::TreeSize Size = Proctree::Tree::predictSize(Tree.mProperties);
+	const int32 VertNum = Size.mVertCount + Size.mSeamVertCount;
+
+	TArray<Proctree::fvec3> Positions;
+	TArray<uint32> Indices32;
+	TArray<uint16> Indices16;
+	TArray<Proctree::IndexRange> Ranges;
+	Positions.SetNumUninitialized(VertNum);
+	Indices32.SetNumUninitialized(Size.mFaceCount * 3);
+	Indices16.SetNumUninitialized(Size.mFaceCount * 3);
+	Ranges.SetNumUninitialized(16);
+
+	Proctree::OutputFormat Format;
+	Proctree::MeshStreams& Streams = Format.mBranches;
+	Streams.mPosition = Positions.GetData();
+	Streams.mIndex = Indices32.GetData();
+	Streams.mIndex16 = Indices16.GetData();
+	Streams.mIndexRanges = Ranges.GetData();
+	Streams.mIndexRangeCapacity = Ranges.Num();
+	Tree.generate(Format);
+
+	// The same tree with 32-bit indices only, to compare the triangles against
+	Proctree::Tree Reference;
+	Reference.mProperties = Tree.mProperties;
+	TArray<Proctree::fvec3> RefPositions;
+	TArray<uint32> RefIndices;
+	RefPositions.SetNumUninitialized(VertNum);
+	RefIndices.SetNumUninitialized(Size.mFaceCount * 3);
+	Proctree::OutputFormat RefFormat;
+	RefFormat.mBranches.mPosition = RefPositions.GetData();
+	RefFormat.mBranches.mIndex = RefIndices.GetData();
+	Reference.generate(RefFormat);
+
+	TestTrue(TEXT("Bark section has more than 65536 vertices"), RefFormat.mBranches.mVertCount > 0x10000);
+	if (!TestTrue(TEXT("Bark section comes out with 16-bit ranges"), Streams.mIndexRangeCount > 0))
+	{
+		return false;
+	}
+	TestTrue(TEXT("Vertex copies fit the predicted size"), Streams.mVertCount <= VertNum);
+
+	int32 Covered = 0;
+	int32 Mismatched = 0;
+	for (int32 RangeIndex = 0; RangeIndex < Streams.mIndexRangeCount; RangeIndex++)
+	{
+		const Proctree::IndexRange& Range = Ranges[RangeIndex];
+		TestEqual(TEXT("Ranges follow each other"), Range.mFirstIndex, Covered);
+		TestTrue(TEXT("Range spans at most 65536 vertices"), Range.mVertexCount <= 0x10000);
+		TestTrue(TEXT("Range vertices are written"), Range.mBaseVertex + Range.mVertexCount <= Streams.mVertCount);
+		for (int32 Index = Range.mFirstIndex; Index < Range.mFirstIndex + Range.mIndexCount; Index++)
+		{
+			const Proctree::fvec3& A = Positions[Indices16[Index] + Range.mBaseVertex];
+			const Proctree::fvec3& B = RefPositions[RefIndices[Index]];
+			Mismatched += Indices16[Index] >= Range.mVertexCount || A.x != B.x || A.y != B.y || A.z != B.z;
+		}
+		Covered += Range.mIndexCount;
+	}
+	TestEqual(TEXT("Ranges cover every face"), Covered, RefFormat.mBranches.mFaceCount * 3);
+	TestEqual(TEXT("Corners that differ from the 32-bit mesh"), Mismatched, 0);
+	return true;
+}
+
+#endif // WITH_DEV_AUTOMATION_TESTS
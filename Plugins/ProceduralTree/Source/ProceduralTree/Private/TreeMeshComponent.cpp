@@ -27,6 +27,8 @@ DECLARE_CYCLE_STAT(TEXT("Create TreeMesh Proxy"), STAT_ProceduralTreeMesh_Create
 DECLARE_CYCLE_STAT(TEXT("Create Tree Mesh Section"), STAT_ProceduralTreeMesh_CreateMeshSection, STATGROUP_ProceduralTreeMesh);
 DECLARE_CYCLE_STAT(TEXT("Get Tree Mesh Elements"), STAT_ProceduralTreeMesh_GetMeshElements, STATGROUP_ProceduralTreeMesh);
 DECLARE_CYCLE_STAT(TEXT("Update Collision"), STAT_ProceduralTreeMesh_UpdateCollision, STATGROUP_ProceduralTreeMesh);
+DECLARE_FLOAT_COUNTER_STAT(TEXT("Bark ACMR before"), STAT_ProceduralTreeMesh_BarkAcmrBefore, STATGROUP_ProceduralTreeMesh);
+DECLARE_FLOAT_COUNTER_STAT(TEXT("Bark ACMR after"), STAT_ProceduralTreeMesh_BarkAcmrAfter, STATGROUP_ProceduralTreeMesh);
 
 /** Class representing a single section of the proc tree mesh */
 class FProcTreeMeshProxySection
@@ -38,6 +40,14 @@ public:
 	FStaticMeshVertexBuffers VertexBuffers;
 	/** Index buffer for this section */
 	FDynamicMeshIndexBuffer32 IndexBuffer;
+	/** Index buffer of a compact section, drawn range by range */
+	FDynamicMeshIndexBuffer16 IndexBuffer16;
+	/** Ranges of IndexBuffer16, empty when IndexBuffer is used */
+	TArray<FProcTreeIndexRange> IndexRanges;
+	/** Face count of each progressive LOD level, empty for twigs */
+	TArray<int32> LevelFaceEnds;
+	/** Number of faces in the section */
+	int32 NumFaces;
 	/** Vertex factory for this section */
 	FLocalVertexFactory VertexFactory;
 	/** Whether this section is currently visible */
@@ -45,6 +55,7 @@ public:
 
 	FProcTreeMeshProxySection(ERHIFeatureLevel::Type InFeatureLevel)
 	: Material(NULL)
+	, NumFaces(0)
 	, VertexFactory(InFeatureLevel, "FProcTreeMeshSceneProxy")
 	, bSectionVisible(true)
 	{}
@@ -65,6 +76,10 @@ public:
 		: FPrimitiveSceneProxy(Component)
 		, BodySetup(Component->GetBodySetup())
 		, MaterialRelevance(Component->GetMaterialRelevance(GetScene().GetFeatureLevel()))
+		, bProgressiveLod(Component->Props.bProgressiveLod && Component->Props.Lods.Num() == 0)
+		, FullDetailScreenSize(Component->Props.FullDetailScreenSize)
+		, NumLodSections(1)
+		, LodHysteresis(Component->Props.LodHysteresis)
 	{
 
 		const FColor DefaultVertColor = FColor::White;
@@ -73,54 +88,102 @@ public:
 		const FProcTreeMeshTangent DefaultTangent = FProcTreeMeshTangent();
 		const FVector DefaultNormal = FVector(0.f, 0.f, 1.f);
 
+		// The sections of every LOD follow each other, the full detail ones first
+		TArray<const FProcTreeMeshSection*> SrcSections;
+		for (const FProcTreeMeshSection& SrcSection : Component->TreeMeshSections)
+		{
+			SrcSections.Add(&SrcSection);
+		}
+		if (SrcSections.Num() > 0)
+		{
+			NumLodSections = SrcSections.Num();
+			const int32 NumLods = FMath::Min(Component->Props.Lods.Num(), Component->LodSections.Num() / NumLodSections);
+			for (int32 LodIdx = 0; LodIdx < NumLods; LodIdx++)
+			{
+				LodScreenSizes.Add(Component->Props.Lods[LodIdx].ScreenSize);
+				for (int32 SectionIdx = 0; SectionIdx < NumLodSections; SectionIdx++)
+				{
+					SrcSections.Add(&Component->LodSections[LodIdx * NumLodSections + SectionIdx]);
+				}
+			}
+		}
+
 		// Copy each section
-		const int32 NumSections = Component->TreeMeshSections.Num();
+		const int32 NumSections = SrcSections.Num();
 		Sections.AddZeroed(NumSections);
 		for (int SectionIdx = 0; SectionIdx < NumSections; SectionIdx++)
 		{
-			FProcTreeMeshSection& SrcSection = Component->TreeMeshSections[SectionIdx];
-			if (SrcSection.IndexBuffer.Num() > 0 && SrcSection.Vertices.Num() > 0)
+			// Instanced twigs are drawn from a copy of the card per instance
+			const FProcTreeMeshSection* SrcSectionPtr = SrcSections[SectionIdx];
+			FProcTreeMeshSection ExpandedSection;
+			if (SrcSectionPtr->TwigInstances.Num() > 0)
+			{
+				UProceduralTreeComponent::ExpandTwigInstances(*SrcSectionPtr, ExpandedSection);
+				SrcSectionPtr = &ExpandedSection;
+			}
+
+			const FProcTreeMeshSection& SrcSection = *SrcSectionPtr;
+			if (SrcSection.GetNumIndices() > 0 && SrcSection.Vertices.Num() > 0)
 			{
 				FProcTreeMeshProxySection* NewSection = new FProcTreeMeshProxySection(GetScene().GetFeatureLevel());
 
 				// Copy data from vertex buffer
 				const int32 NumVerts = SrcSection.Vertices.Num();
 
-				// Allocate verts
-
-				TArray<FDynamicMeshVertex> Vertices;
-				Vertices.SetNumUninitialized(NumVerts);
-				// Copy verts
-				for (int VertIdx = 0; VertIdx < NumVerts; VertIdx++)
+				if (SrcSection.PackedNormals.Num() == NumVerts)
 				{
-					FDynamicMeshVertex& Vert = Vertices[VertIdx];
-					Vert.Position = SrcSection.Vertices[VertIdx];
-					Vert.Color = FColor::White;
-					Vert.TextureCoordinate[0] = (SrcSection.TextureCoordinates0.Num() == NumVerts) ? SrcSection.TextureCoordinates0[VertIdx] : FVector2D::ZeroVector;
-					Vert.TangentX = (SrcSection.Tangents.Num() == NumVerts) ? SrcSection.Tangents[VertIdx].TangentX : DefaultTangent.TangentX;
-					Vert.TangentZ = (SrcSection.Normals.Num() == NumVerts) ? SrcSection.Normals[VertIdx] : DefaultNormal;
-					Vert.TangentZ.Vector.W = ((SrcSection.Tangents.Num() == NumVerts) && SrcSection.Tangents[VertIdx].bFlipTangentY) ? -127 : 127;
+					InitCompactVertexBuffers(NewSection, SrcSection);
 				}
+				else
+				{
+					// Allocate verts
 
-				// Copy index buffer
-				NewSection->IndexBuffer.Indices = SrcSection.IndexBuffer;
+					TArray<FDynamicMeshVertex> Vertices;
+					Vertices.SetNumUninitialized(NumVerts);
+					// Copy verts
+					for (int VertIdx = 0; VertIdx < NumVerts; VertIdx++)
+					{
+						FDynamicMeshVertex& Vert = Vertices[VertIdx];
+						Vert.Position = SrcSection.Vertices[VertIdx];
+						Vert.Color = FColor::White;
+						Vert.TextureCoordinate[0] = (SrcSection.TextureCoordinates0.Num() == NumVerts) ? SrcSection.TextureCoordinates0[VertIdx] : FVector2D::ZeroVector;
+						Vert.TangentX = (SrcSection.Tangents.Num() == NumVerts) ? SrcSection.Tangents[VertIdx].TangentX : DefaultTangent.TangentX;
+						Vert.TangentZ = (SrcSection.Normals.Num() == NumVerts) ? SrcSection.Normals[VertIdx] : DefaultNormal;
+						Vert.TangentZ.Vector.W = ((SrcSection.Tangents.Num() == NumVerts) && SrcSection.Tangents[VertIdx].bFlipTangentY) ? -127 : 127;
+					}
 
-				NewSection->VertexBuffers.InitFromDynamicVertex(&NewSection->VertexFactory, Vertices, 4);
+					NewSection->VertexBuffers.InitFromDynamicVertex(&NewSection->VertexFactory, Vertices, 4);
+				}
+
+				// Copy index buffer
+				if (SrcSection.IndexRanges.Num() > 0)
+				{
+					NewSection->IndexBuffer16.Indices = SrcSection.IndexBuffer16;
+					NewSection->IndexRanges = SrcSection.IndexRanges;
+					BeginInitResource(&NewSection->IndexBuffer16);
+				}
+				else
+				{
+					NewSection->IndexBuffer.Indices = SrcSection.IndexBuffer;
+					BeginInitResource(&NewSection->IndexBuffer);
+				}
 
 				// Enqueue initialization of render resource
 				BeginInitResource(&NewSection->VertexBuffers.PositionVertexBuffer);
 				BeginInitResource(&NewSection->VertexBuffers.StaticMeshVertexBuffer);
 				BeginInitResource(&NewSection->VertexBuffers.ColorVertexBuffer);
-				BeginInitResource(&NewSection->IndexBuffer);
 				BeginInitResource(&NewSection->VertexFactory);
 
 				// Grab material
-				NewSection->Material = Component->GetMaterial(SectionIdx);
+				NewSection->Material = Component->GetMaterial(SectionIdx % NumLodSections);
 				if (NewSection->Material == NULL)
 				{
 					NewSection->Material = UMaterial::GetDefaultMaterial(MD_Surface);
 				}
 
+				NewSection->NumFaces = SrcSection.GetNumIndices() / 3;
+				NewSection->LevelFaceEnds = SrcSection.LevelFaceEnds;
+
 				// Copy visibility info
 				NewSection->bSectionVisible = SrcSection.bSectionVisible;
 
@@ -140,6 +203,7 @@ public:
 				Section->VertexBuffers.StaticMeshVertexBuffer.ReleaseResource();
 				Section->VertexBuffers.ColorVertexBuffer.ReleaseResource();
 				Section->IndexBuffer.ReleaseResource();
+				Section->IndexBuffer16.ReleaseResource();
 				Section->VertexFactory.ReleaseResource();
 				delete Section;
 			}
@@ -165,36 +229,73 @@ public:
 			Collector.RegisterOneFrameMaterialProxy(WireframeMaterialInstance);
 		}
 
+		// Each view draws the sections of one LOD
+		TArray<int32, TInlineAllocator<4>> LodOfView;
+		for (int32 ViewIndex = 0; ViewIndex < Views.Num(); ViewIndex++)
+		{
+			LodOfView.Add((VisibilityMap & (1 << ViewIndex)) ? GetLodForView(Views[ViewIndex]) : 0);
+		}
+
 		// Iterate over sections
-		for (const FProcTreeMeshProxySection* Section : Sections)
+		for (int32 SectionIdx = 0; SectionIdx < Sections.Num(); SectionIdx++)
 		{
+			const FProcTreeMeshProxySection* Section = Sections[SectionIdx];
 			if (Section != nullptr && Section->bSectionVisible)
 			{
 				FMaterialRenderProxy* MaterialProxy = bWireframe ? WireframeMaterialInstance : Section->Material->GetRenderProxy(IsSelected());
+				const int32 SectionLod = SectionIdx / NumLodSections;
 
 				// For each view..
 				for (int32 ViewIndex = 0; ViewIndex < Views.Num(); ViewIndex++)
 				{
-					if (VisibilityMap & (1 << ViewIndex))
+					if ((VisibilityMap & (1 << ViewIndex)) && LodOfView[ViewIndex] == SectionLod)
 					{
 						const FSceneView* View = Views[ViewIndex];
-						// Draw the mesh.
-						FMeshBatch& Mesh = Collector.AllocateMesh();
-						FMeshBatchElement& BatchElement = Mesh.Elements[0];
-						BatchElement.IndexBuffer = &Section->IndexBuffer;
-						Mesh.bWireframe = bWireframe;
-						Mesh.VertexFactory = &Section->VertexFactory;
-						Mesh.MaterialRenderProxy = MaterialProxy;
-						BatchElement.PrimitiveUniformBuffer = CreatePrimitiveUniformBufferImmediate(GetLocalToWorld(), GetBounds(), GetLocalBounds(), true, UseEditorDepthTest());
-						BatchElement.FirstIndex = 0;
-						BatchElement.NumPrimitives = Section->IndexBuffer.Indices.Num() / 3;
-						BatchElement.MinVertexIndex = 0;
-						BatchElement.MaxVertexIndex = Section->VertexBuffers.PositionVertexBuffer.GetNumVertices() - 1;
-						Mesh.ReverseCulling = IsLocalToWorldDeterminantNegative();
-						Mesh.Type = PT_TriangleList;
-						Mesh.DepthPriorityGroup = SDPG_World;
-						Mesh.bCanApplyViewModeOverrides = false;
-						Collector.AddMesh(ViewIndex, Mesh);
+						const int32 NumFacesToDraw = GetNumFacesToDraw(Section, View);
+						// Draw the mesh, one batch per 16-bit index range
+						const bool bRanges = Section->IndexRanges.Num() > 0;
+						const int32 NumBatches = bRanges ? Section->IndexRanges.Num() : 1;
+						for (int32 BatchIdx = 0; BatchIdx < NumBatches; BatchIdx++)
+						{
+							// Ranges past the drawn prefix are skipped, the one it ends in is cut short
+							const int32 NumPrimitives = bRanges
+								? FMath::Min(Section->IndexRanges[BatchIdx].NumIndices / 3, NumFacesToDraw - Section->IndexRanges[BatchIdx].FirstIndex / 3)
+								: NumFacesToDraw;
+							if (NumPrimitives <= 0)
+							{
+								break;
+							}
+
+							FMeshBatch& Mesh = Collector.AllocateMesh();
+							FMeshBatchElement& BatchElement = Mesh.Elements[0];
+							Mesh.bWireframe = bWireframe;
+							Mesh.VertexFactory = &Section->VertexFactory;
+							Mesh.MaterialRenderProxy = MaterialProxy;
+							BatchElement.PrimitiveUniformBuffer = CreatePrimitiveUniformBufferImmediate(GetLocalToWorld(), GetBounds(), GetLocalBounds(), true, UseEditorDepthTest());
+							if (bRanges)
+							{
+								const FProcTreeIndexRange& Range = Section->IndexRanges[BatchIdx];
+								BatchElement.IndexBuffer = &Section->IndexBuffer16;
+								BatchElement.FirstIndex = Range.FirstIndex;
+								BatchElement.NumPrimitives = NumPrimitives;
+								BatchElement.BaseVertexIndex = Range.BaseVertex;
+								BatchElement.MinVertexIndex = 0;
+								BatchElement.MaxVertexIndex = Range.NumVertices - 1;
+							}
+							else
+							{
+								BatchElement.IndexBuffer = &Section->IndexBuffer;
+								BatchElement.FirstIndex = 0;
+								BatchElement.NumPrimitives = NumPrimitives;
+								BatchElement.MinVertexIndex = 0;
+								BatchElement.MaxVertexIndex = Section->VertexBuffers.PositionVertexBuffer.GetNumVertices() - 1;
+							}
+							Mesh.ReverseCulling = IsLocalToWorldDeterminantNegative();
+							Mesh.Type = PT_TriangleList;
+							Mesh.DepthPriorityGroup = SDPG_World;
+							Mesh.bCanApplyViewModeOverrides = false;
+							Collector.AddMesh(ViewIndex, Mesh);
+						}
 					}
 				}
 			}
@@ -249,12 +350,159 @@ public:
 	}
 
 private:
+	/** LOD a view draws. A view keeps the LOD it drew last until the screen size is past a switch point by the hysteresis share; views without a key, or past MaxViewLods drawn in one frame, switch right at the switch points */
+	int32 GetLodForView(const FSceneView* View) const
+	{
+		if (LodScreenSizes.Num() == 0)
+		{
+			return 0;
+		}
+
+		const float ScreenSize = ComputeBoundsScreenSize(GetBounds().Origin, GetBounds().SphereRadius, *View);
+		const uint32 ViewKey = View->GetViewKey();
+		const uint32 FrameNumber = View->Family->FrameNumber;
+		FViewLod* Last = (ViewKey != 0) ? ViewLods.Find(ViewKey) : nullptr;
+		if (!Last && ViewKey != 0)
+		{
+			// Views not drawn this frame make room; they start over if they come back
+			if (ViewLods.Num() >= MaxViewLods)
+			{
+				for (auto It = ViewLods.CreateIterator(); It; ++It)
+				{
+					if (It.Value().FrameNumber != FrameNumber)
+					{
+						It.RemoveCurrent();
+					}
+				}
+			}
+			if (ViewLods.Num() < MaxViewLods)
+			{
+				Last = &ViewLods.Add(ViewKey, FViewLod{ 0, FrameNumber });
+			}
+		}
+
+		if (!Last)
+		{
+			int32 Lod = 0;
+			while (Lod < LodScreenSizes.Num() && ScreenSize < LodScreenSizes[Lod])
+			{
+				Lod++;
+			}
+			return Lod;
+		}
+
+		int32& Lod = Last->Lod;
+		Last->FrameNumber = FrameNumber;
+		Lod = FMath::Min(Lod, LodScreenSizes.Num());
+		while (Lod < LodScreenSizes.Num() && ScreenSize < LodScreenSizes[Lod] * (1.0f - LodHysteresis))
+		{
+			Lod++;
+		}
+		while (Lod > 0 && ScreenSize > LodScreenSizes[Lod - 1] * (1.0f + LodHysteresis))
+		{
+			Lod--;
+		}
+		return Lod;
+	}
+
+	/** Number of leading faces of a section to draw in a view; all of them unless the tree is progressive and small on screen */
+	int32 GetNumFacesToDraw(const FProcTreeMeshProxySection* Section, const FSceneView* View) const
+	{
+		if (!bProgressiveLod || Section->NumFaces == 0)
+		{
+			return Section->NumFaces;
+		}
+
+		const float ScreenSize = ComputeBoundsScreenSize(GetBounds().Origin, GetBounds().SphereRadius, *View);
+		const float Halvings = FMath::Max(0.0f, FMath::Log2(FullDetailScreenSize / FMath::Max(ScreenSize, SMALL_NUMBER)));
+
+		// Bark drops its deepest branch level per halving, down to the trunk
+		const int32 NumLevels = Section->LevelFaceEnds.Num();
+		if (NumLevels > 0)
+		{
+			const int32 Level = FMath::Max(NumLevels - 1 - FMath::FloorToInt(Halvings), 0);
+			return Section->LevelFaceEnds[Level];
+		}
+
+		// Twigs are ordered outside in, whole cards of four faces at a time
+		const int32 NumCards = Section->NumFaces / 4;
+		const int32 NumCardsToDraw = FMath::Clamp(FMath::CeilToInt(NumCards * FMath::Pow(0.5f, Halvings)), 1, NumCards);
+		return NumCardsToDraw * 4;
+	}
+
+	/** Fills the vertex buffers of a compact section: packed tangent basis, one half precision UV channel */
+	static void InitCompactVertexBuffers(FProcTreeMeshProxySection* Section, const FProcTreeMeshSection& SrcSection)
+	{
+		const int32 NumVerts = SrcSection.Vertices.Num();
+		FStaticMeshVertexBuffers& Buffers = Section->VertexBuffers;
+
+		Buffers.PositionVertexBuffer.Init(SrcSection.Vertices);
+		Buffers.StaticMeshVertexBuffer.SetUseHighPrecisionTangentBasis(false);
+		Buffers.StaticMeshVertexBuffer.SetUseFullPrecisionUVs(false);
+		Buffers.StaticMeshVertexBuffer.Init(NumVerts, 1);
+		Buffers.ColorVertexBuffer.InitFromSingleColor(FColor::White, NumVerts);
+		for (int32 VertIdx = 0; VertIdx < NumVerts; VertIdx++)
+		{
+			const FPackedNormal& Normal = SrcSection.PackedNormals[VertIdx];
+			const FVector TangentX = SrcSection.PackedTangents[VertIdx].ToFVector();
+			const FVector TangentZ = Normal.ToFVector();
+			const FVector TangentY = (TangentZ ^ TangentX) * (Normal.Vector.W < 0 ? -1.0f : 1.0f);
+			Buffers.StaticMeshVertexBuffer.SetVertexTangents(VertIdx, TangentX, TangentY, TangentZ);
+			Buffers.StaticMeshVertexBuffer.SetVertexUV(VertIdx, 0, FVector2D(SrcSection.HalfTextureCoordinates0[VertIdx]));
+		}
+
+		FStaticMeshVertexBuffers* VertexBuffers = &Section->VertexBuffers;
+		FLocalVertexFactory* VertexFactory = &Section->VertexFactory;
+		ENQUEUE_RENDER_COMMAND(ProcTreeCompactVertexFactoryInit)(
+			[VertexBuffers, VertexFactory](FRHICommandListImmediate& RHICmdList)
+		{
+			VertexBuffers->PositionVertexBuffer.InitResource();
+			VertexBuffers->StaticMeshVertexBuffer.InitResource();
+			VertexBuffers->ColorVertexBuffer.InitResource();
+
+			FLocalVertexFactory::FDataType Data;
+			VertexBuffers->PositionVertexBuffer.BindPositionVertexBuffer(VertexFactory, Data);
+			VertexBuffers->StaticMeshVertexBuffer.BindTangentVertexBuffer(VertexFactory, Data);
+			VertexBuffers->StaticMeshVertexBuffer.BindPackedTexCoordVertexBuffer(VertexFactory, Data);
+			VertexBuffers->ColorVertexBuffer.BindColorVertexBuffer(VertexFactory, Data);
+			VertexFactory->SetData(Data);
+		});
+	}
+
 	/** Array of sections */
 	TArray<FProcTreeMeshProxySection*> Sections;
 
 	UBodySetup* BodySetup;
 
 	FMaterialRelevance MaterialRelevance;
+
+	/** Whether sections draw a prefix of their faces that shrinks with the screen size */
+	bool bProgressiveLod;
+
+	/** Screen size at and above which every face is drawn */
+	float FullDetailScreenSize;
+
+	/** Sections of each LOD, Sections holds them LOD after LOD */
+	int32 NumLodSections;
+
+	/** Screen size below which each coarser LOD is drawn, nearest first */
+	TArray<float> LodScreenSizes;
+
+	/** Share of a switch point's screen size a view has to pass it by to change LOD */
+	float LodHysteresis;
+
+	/** LOD a view drew last and the frame it drew it in */
+	struct FViewLod
+	{
+		int32 Lod;
+		uint32 FrameNumber;
+	};
+
+	/** Most views whose last LOD is kept */
+	static const int32 MaxViewLods = 16;
+
+	/** Last LOD of each view, by view key; only touched on the render thread */
+	mutable TMap<uint32, FViewLod> ViewLods;
 };
 
 //////////////////////////////////////////////////////////////////////////
@@ -295,17 +543,148 @@ void UProceduralTreeComponent::PostEditChangeProperty(FPropertyChangedEvent& Pro
 }
 #endif //WITH_EDITOR
 
+// A section needs more than one 16-bit range past 65536 vertices; past
+// this many ranges it keeps 32-bit indices
+static const int32 MaxIndexRanges = 16;
+
+/** Sizes the arrays of a section for the largest mesh the generator can write into it and points its streams at them */
+static void BindSectionStreams(FProcTreeMeshSection& Section, Proctree::MeshStreams& Streams, int32 VertNum, int32 FacesNum, bool bCompactFormats)
+{
+	Section.Vertices.SetNumUninitialized(VertNum);
+	Section.IndexBuffer.SetNumUninitialized(FacesNum * 3);
+	Streams.mPosition = reinterpret_cast<Proctree::fvec3*>(Section.Vertices.GetData());
+	Streams.mIndex = Section.IndexBuffer.GetData();
+
+	if (bCompactFormats)
+	{
+		// Switching formats frees the arrays of the other one
+		Section.Normals.Empty();
+		Section.Tangents.Empty();
+		Section.TextureCoordinates0.Empty();
+
+		Section.PackedNormals.SetNumUninitialized(VertNum);
+		Section.PackedTangents.SetNumUninitialized(VertNum);
+		Section.HalfTextureCoordinates0.SetNumUninitialized(VertNum);
+		Section.IndexBuffer16.SetNumUninitialized(FacesNum * 3);
+		Section.IndexRanges.SetNumUninitialized(MaxIndexRanges);
+
+		Streams.mPackedNormal = reinterpret_cast<uint32*>(Section.PackedNormals.GetData());
+		Streams.mPackedTangent = reinterpret_cast<uint32*>(Section.PackedTangents.GetData());
+		Streams.mHalfUV = reinterpret_cast<uint32*>(Section.HalfTextureCoordinates0.GetData());
+		Streams.mIndex16 = Section.IndexBuffer16.GetData();
+		Streams.mIndexRanges = reinterpret_cast<Proctree::IndexRange*>(Section.IndexRanges.GetData());
+		Streams.mIndexRangeCapacity = MaxIndexRanges;
+	}
+	else
+	{
+		Section.PackedNormals.Empty();
+		Section.PackedTangents.Empty();
+		Section.HalfTextureCoordinates0.Empty();
+		Section.IndexBuffer16.Empty();
+		Section.IndexRanges.Empty();
+
+		Section.Normals.SetNumUninitialized(VertNum);
+		Section.Tangents.SetNumUninitialized(VertNum);
+		Section.TextureCoordinates0.SetNumUninitialized(VertNum);
+
+		Streams.mNormal = reinterpret_cast<Proctree::fvec3*>(Section.Normals.GetData());
+		Streams.mTangent = reinterpret_cast<Proctree::fvec3*>(&Section.Tangents.GetData()->TangentX);
+		Streams.mTangentStride = sizeof(FProcTreeMeshTangent);
+		Streams.mTangentFlip = &Section.Tangents.GetData()->bFlipTangentY;
+		Streams.mTangentFlipStride = sizeof(FProcTreeMeshTangent);
+		Streams.mUV = reinterpret_cast<Proctree::fvec2*>(Section.TextureCoordinates0.GetData());
+	}
+}
+
+/** Trims the arrays of a section to the mesh the generator wrote into them */
+static void TrimSection(FProcTreeMeshSection& Section, const Proctree::MeshStreams& Streams, bool bCompactFormats)
+{
+	const int32 VertNum = Streams.mVertCount;
+	const int32 FacesNum = Streams.mFaceCount;
+
+	Section.Vertices.SetNum(VertNum, false);
+	if (bCompactFormats)
+	{
+		Section.PackedNormals.SetNum(VertNum, false);
+		Section.PackedTangents.SetNum(VertNum, false);
+		Section.HalfTextureCoordinates0.SetNum(VertNum, false);
+
+		// Only one of the index buffers was written
+		Section.IndexRanges.SetNum(Streams.mIndexRangeCount, false);
+		if (Streams.mIndexRangeCount > 0)
+		{
+			Section.IndexBuffer16.SetNum(FacesNum * 3, false);
+			Section.IndexBuffer.Empty();
+		}
+		else
+		{
+			Section.IndexBuffer16.Empty();
+			Section.IndexBuffer.SetNum(FacesNum * 3, false);
+		}
+	}
+	else
+	{
+		Section.Normals.SetNum(VertNum, false);
+		Section.Tangents.SetNum(VertNum, false);
+		Section.TextureCoordinates0.SetNum(VertNum, false);
+		Section.IndexBuffer.SetNum(FacesNum * 3, false);
+	}
+
+	// The arrays were sized for the seam bound, up to about twice the mesh;
+	// the section keeps only what it uses for as long as it lives
+	Section.Vertices.Shrink();
+	Section.Normals.Shrink();
+	Section.Tangents.Shrink();
+	Section.TextureCoordinates0.Shrink();
+	Section.IndexBuffer.Shrink();
+	Section.PackedNormals.Shrink();
+	Section.PackedTangents.Shrink();
+	Section.HalfTextureCoordinates0.Shrink();
+	Section.IndexBuffer16.Shrink();
+	Section.IndexRanges.Shrink();
+
+	if (VertNum > 0)
+	{
+		Section.SectionLocalBox = FBox(
+			FVector(Streams.mBoundsMin.x, Streams.mBoundsMin.y, Streams.mBoundsMin.z),
+			FVector(Streams.mBoundsMax.x, Streams.mBoundsMax.y, Streams.mBoundsMax.z));
+	}
+}
+
+/** Puts the card every twig instance of a section copies in its mesh arrays; the section keeps the bounds of the placed cards */
+static void WriteTwigCard(FProcTreeMeshSection& Section, const Proctree::OutputFormat& Format, bool bCompactFormats)
+{
+	Section.TwigInstances.SetNum(Format.mTwigInstanceCount, false);
+	Section.TwigInstances.Shrink();
+	if (Format.mTwigInstanceCount == 0)
+	{
+		return;
+	}
+
+	Proctree::MeshStreams CardStreams;
+	BindSectionStreams(Section, CardStreams, 8, 4, bCompactFormats);
+	Proctree::Tree::writeTwigCard(CardStreams, Format.mSwapYZ);
+	TrimSection(Section, CardStreams, bCompactFormats);
+	Section.SectionLocalBox = FBox(
+		FVector(Format.mTwigs.mBoundsMin.x, Format.mTwigs.mBoundsMin.y, Format.mTwigs.mBoundsMin.z),
+		FVector(Format.mTwigs.mBoundsMax.x, Format.mTwigs.mBoundsMax.y, Format.mTwigs.mBoundsMax.z));
+}
+
 void UProceduralTreeComponent::GenerateTreeMesh()
 {
 	SCOPE_CYCLE_COUNTER(STAT_ProceduralTreeMesh_CreateMeshSection);
 
-	Proctree::Tree TempTree;
+	// The per-thread context keeps its buffers between calls, so regenerating
+	// while tweaking properties does not reallocate them
+	Proctree::Tree TempTree(Proctree::GeneratorContext::get());
 
 
 
 	{
 		TempTree.mProperties.mSeed = Props.Seed;
 		TempTree.mProperties.mSegments = Props.HalfSegments * 2;
+		TempTree.mProperties.mSegmentFalloff = Props.SegmentFalloff;
+		TempTree.mProperties.mMinSegments = Props.MinHalfSegments * 2;
 		TempTree.mProperties.mLevels = Props.Levels;
 		TempTree.mProperties.mVMultiplier = Props.VMultiplier;
 		TempTree.mProperties.mTwigScale = Props.TwigScale;
@@ -318,6 +697,8 @@ void UProceduralTreeComponent::GenerateTreeMesh()
 		TempTree.mProperties.mDropAmount = Props.DropAmount;
 		TempTree.mProperties.mGrowAmount = Props.GrowAmount;
 		TempTree.mProperties.mSweepAmount = Props.SweepAmount;
+		TempTree.mProperties.mPruneOverlap = Props.PruneOverlap;
+		TempTree.mProperties.mTwigCullOcclusion = Props.TwigCullOcclusion;
 		TempTree.mProperties.mMaxRadius = Props.MaxRadius;
 		TempTree.mProperties.mClimbRate = Props.ClimbRate;
 		TempTree.mProperties.mTrunkKink = Props.TrunkKink;
@@ -326,9 +707,18 @@ void UProceduralTreeComponent::GenerateTreeMesh()
 		TempTree.mProperties.mRadiusFalloffRate = Props.RadiusFalloffRate;
 		TempTree.mProperties.mTwistRate = Props.TwistRate;
 		TempTree.mProperties.mTrunkLength = Props.TrunkLength;
+		TempTree.mProperties.mRandomMode = (Props.RandomMode == EProcTreeRandomMode::Hash) ? Proctree::RANDOM_HASH : Proctree::RANDOM_LEGACY;
+		TempTree.mProperties.mAnalyticNormals = Props.bAnalyticNormals;
+		TempTree.mProperties.mOptimizeVertexCache = Props.bOptimizeVertexCache;
+		TempTree.mProperties.mTwigInstances = Props.bInstancedTwigs;
+		TempTree.mProperties.mProgressiveOrder = Props.bProgressiveLod && Props.Lods.Num() == 0;
 	}
 
-	TempTree.generate();
+	Proctree::BudgetCuts Cuts = TempTree.fitBudget(Props.MaxTriangles, Props.MaxVertices);
+	BudgetReport.HalfSegmentsCut = Cuts.mSegments / 2;
+	BudgetReport.LevelsCut = Cuts.mLevels;
+	BudgetReport.bTwigsDropped = Cuts.mTwigs;
+	BudgetReport.bWithinBudget = Cuts.mFits;
 
 	if (TreeMeshSections.Num() != 2)
 	{
@@ -339,44 +729,170 @@ void UProceduralTreeComponent::GenerateTreeMesh()
 	TreeMeshSections[1].Reset();
 
 	TreeMeshSections[0].bEnableCollision = bEnableCollision;
-	TreeMeshSections[1].bEnableCollision = bEnableCollision;
+	TreeMeshSections[1].bEnableCollision = bEnableCollision && !Props.bInstancedTwigs;
+
+	LodSections.SetNum(Props.Lods.Num() * 2);
+	for (FProcTreeMeshSection& Section : LodSections)
+	{
+		Section.Reset();
+	}
+
+	// The generator writes Z-up, centimetre data straight into the section
+	// arrays. They are sized for the largest mesh the properties can produce
+	// and trimmed to the real counts, allocations included, once those are
+	// known.
+	static_assert(sizeof(FVector) == sizeof(Proctree::fvec3) && sizeof(FVector2D) == sizeof(Proctree::fvec2), "Section arrays must match the generator's vector layout");
+	static_assert(sizeof(FPackedNormal) == sizeof(uint32) && sizeof(FVector2DHalf) == sizeof(uint32) && sizeof(FProcTreeIndexRange) == sizeof(Proctree::IndexRange), "Compact section arrays must match the generator's packed layout");
+	static_assert(sizeof(FProcTreeTwigInstance) == sizeof(Proctree::TwigInstance) && STRUCT_OFFSET(FProcTreeTwigInstance, Rotation) == STRUCT_OFFSET(Proctree::TwigInstance, mRotation), "Twig instances must match the generator's layout");
+
+	// Every LOD is meshed from the same branches, in one generation
+	const int32 NumLods = 1 + Props.Lods.Num();
+	TArray<Proctree::OutputFormat> Formats;
+	TArray<Proctree::LodSettings> Settings;
+	Formats.SetNum(NumLods);
+	Settings.SetNumZeroed(NumLods);
+	for (int32 LodIdx = 0; LodIdx < NumLods; LodIdx++)
+	{
+		Proctree::OutputFormat& Format = Formats[LodIdx];
+		Format.mSwapYZ = true;
+		Format.mScale = 100.0f;
+
+		// Sized for the ring segments of the LOD, dropped levels only make it smaller
+		Proctree::Properties LodProperties = TempTree.mProperties;
+		if (LodIdx > 0)
+		{
+			const FProcTreeLod& Lod = Props.Lods[LodIdx - 1];
+			Settings[LodIdx].mSegmentsCut = Lod.HalfSegmentsCut * 2;
+			Settings[LodIdx].mLevelsDropped = Lod.LevelsDropped;
+			Settings[LodIdx].mTwigCullOcclusion = Lod.TwigCullOcclusion;
+			LodProperties.mSegments = FMath::Max(LodProperties.mSegments - Lod.HalfSegmentsCut * 2, FMath::Min(LodProperties.mSegments, LodProperties.mMinSegments));
+		}
 
+		Proctree::TreeSize Size = Proctree::Tree::predictSize(LodProperties);
+		FProcTreeMeshSection* Sections = (LodIdx == 0) ? &TreeMeshSections[0] : &LodSections[(LodIdx - 1) * 2];
+		BindSectionStreams(Sections[0], Format.mBranches, Size.mVertCount + Size.mSeamVertCount, Size.mFaceCount, Props.bCompactFormats);
 
+		// Instanced twigs only write their instances; the card follows generation
+		const bool bInstanced = Size.mTwigInstanceCount > 0;
+		BindSectionStreams(Sections[1], Format.mTwigs, bInstanced ? 0 : Size.mTwigVertCount, bInstanced ? 0 : Size.mTwigFaceCount, Props.bCompactFormats);
+		Sections[1].TwigInstances.SetNumUninitialized(Size.mTwigInstanceCount);
+		Format.mTwigInstances = reinterpret_cast<Proctree::TwigInstance*>(Sections[1].TwigInstances.GetData());
+	}
 
-	for (int32 SectionIdex = 0; SectionIdex < 2; SectionIdex++)
+	TempTree.generateLods(Formats.GetData(), Settings.GetData(), NumLods);
+
+	VertexCacheReport.BarkAcmrBefore = TempTree.mCacheReport.mBarkBefore;
+	VertexCacheReport.BarkAcmrAfter = TempTree.mCacheReport.mBarkAfter;
+	VertexCacheReport.TwigAcmrBefore = TempTree.mCacheReport.mTwigBefore;
+	VertexCacheReport.TwigAcmrAfter = TempTree.mCacheReport.mTwigAfter;
+	if (Props.bOptimizeVertexCache)
 	{
+		SET_FLOAT_STAT(STAT_ProceduralTreeMesh_BarkAcmrBefore, VertexCacheReport.BarkAcmrBefore);
+		SET_FLOAT_STAT(STAT_ProceduralTreeMesh_BarkAcmrAfter, VertexCacheReport.BarkAcmrAfter);
+	}
 
+	for (int32 LodIdx = 0; LodIdx < NumLods; LodIdx++)
+	{
+		FProcTreeMeshSection* Sections = (LodIdx == 0) ? &TreeMeshSections[0] : &LodSections[(LodIdx - 1) * 2];
+		TrimSection(Sections[0], Formats[LodIdx].mBranches, Props.bCompactFormats);
+		TrimSection(Sections[1], Formats[LodIdx].mTwigs, Props.bCompactFormats);
+		WriteTwigCard(Sections[1], Formats[LodIdx], Props.bCompactFormats);
+	}
 
-		int32 VertNum = (SectionIdex == 0) ? TempTree.mVertCount : TempTree.mTwigVertCount;
-		int32 FacesNum = (SectionIdex == 0) ? TempTree.mFaceCount : TempTree.mTwigFaceCount;
+	TreeMeshSections[0].LevelFaceEnds.Reset();
+	if (TempTree.mProperties.mProgressiveOrder)
+	{
+		TreeMeshSections[0].LevelFaceEnds.Append(TempTree.mLevelFaceEnd, TempTree.mFaceLevelCount);
+	}
 
-		Proctree::fvec3 *Verts = (SectionIdex == 0) ? TempTree.mVert : TempTree.mTwigVert;
-		Proctree::fvec3 *Norms = (SectionIdex == 0) ? TempTree.mNormal : TempTree.mTwigNormal;
-		Proctree::fvec2 *UVs = (SectionIdex == 0) ? TempTree.mUV : TempTree.mTwigUV;
-		Proctree::ivec3 *Faces = (SectionIdex == 0) ? TempTree.mFace : TempTree.mTwigFace;
+	UpdateLocalBounds(); // Update overall bounds
+	UpdateCollision(); // Mark collision as dirty
+	MarkRenderStateDirty(); // New section requires recreating scene proxy
+}
 
+void UProceduralTreeComponent::ExpandTwigInstances(const FProcTreeMeshSection& Card, FProcTreeMeshSection& Expanded)
+{
+	const int32 NumCardVerts = Card.Vertices.Num();
+	const int32 NumCardIndices = Card.GetNumIndices();
+	const int32 NumInstances = Card.TwigInstances.Num();
+	const bool bCompact = Card.PackedNormals.Num() == NumCardVerts;
+	const int32 NumVerts = NumCardVerts * NumInstances;
+
+	Expanded.Vertices.SetNumUninitialized(NumVerts);
+	if (bCompact)
+	{
+		Expanded.PackedNormals.SetNumUninitialized(NumVerts);
+		Expanded.PackedTangents.SetNumUninitialized(NumVerts);
+		Expanded.HalfTextureCoordinates0.SetNumUninitialized(NumVerts);
+	}
+	else
+	{
+		Expanded.Normals.SetNumUninitialized(NumVerts);
+		Expanded.Tangents.SetNumUninitialized(NumVerts);
+		Expanded.TextureCoordinates0.SetNumUninitialized(NumVerts);
+	}
 
-		for (int32 VertIdx = 0; VertIdx < VertNum; VertIdx++)
+	for (int32 InstanceIdx = 0; InstanceIdx < NumInstances; InstanceIdx++)
+	{
+		const FProcTreeTwigInstance& Instance = Card.TwigInstances[InstanceIdx];
+		for (int32 CardVertIdx = 0; CardVertIdx < NumCardVerts; CardVertIdx++)
 		{
-			TreeMeshSections[SectionIdex].Vertices.Add(FVector(Verts[VertIdx].x, Verts[VertIdx].z, Verts[VertIdx].y) * 100.0f);
-			TreeMeshSections[SectionIdex].Normals.Add(FVector(Norms[VertIdx].x, Norms[VertIdx].z, Norms[VertIdx].y));
-			TreeMeshSections[SectionIdex].TextureCoordinates0.Add(FVector2D(UVs[VertIdx].u, UVs[VertIdx].v));
-			// Update bounding box
-			TreeMeshSections[SectionIdex].SectionLocalBox += TreeMeshSections[SectionIdex].Vertices[VertIdx];
+			const int32 VertIdx = InstanceIdx * NumCardVerts + CardVertIdx;
+			Expanded.Vertices[VertIdx] = Instance.Position + Instance.Rotation.RotateVector(Card.Vertices[CardVertIdx] * Instance.Scale);
+			if (bCompact)
+			{
+				FPackedNormal Normal(Instance.Rotation.RotateVector(Card.PackedNormals[CardVertIdx].ToFVector()));
+				Normal.Vector.W = Card.PackedNormals[CardVertIdx].Vector.W;
+				Expanded.PackedNormals[VertIdx] = Normal;
+				Expanded.PackedTangents[VertIdx] = FPackedNormal(Instance.Rotation.RotateVector(Card.PackedTangents[CardVertIdx].ToFVector()));
+				Expanded.HalfTextureCoordinates0[VertIdx] = Card.HalfTextureCoordinates0[CardVertIdx];
+			}
+			else
+			{
+				Expanded.Normals[VertIdx] = Instance.Rotation.RotateVector(Card.Normals[CardVertIdx]);
+				Expanded.Tangents[VertIdx] = FProcTreeMeshTangent(Instance.Rotation.RotateVector(Card.Tangents[CardVertIdx].TangentX), Card.Tangents[CardVertIdx].bFlipTangentY);
+				Expanded.TextureCoordinates0[VertIdx] = Card.TextureCoordinates0[CardVertIdx];
+			}
 		}
+	}
 
-		for (int32 FaceIdx = 0; FaceIdx < FacesNum; FaceIdx++)
+	if (Card.IndexRanges.Num() > 0)
+	{
+		// One 16-bit range per run of cards that fits in it
+		const int32 CardsPerRange = 65536 / NumCardVerts;
+		Expanded.IndexBuffer16.SetNumUninitialized(NumCardIndices * NumInstances);
+		for (int32 InstanceIdx = 0; InstanceIdx < NumInstances; InstanceIdx++)
 		{
-			TreeMeshSections[SectionIdex].IndexBuffer.Add(Faces[FaceIdx].x);
-			TreeMeshSections[SectionIdex].IndexBuffer.Add(Faces[FaceIdx].y);
-			TreeMeshSections[SectionIdex].IndexBuffer.Add(Faces[FaceIdx].z);
+			if (InstanceIdx % CardsPerRange == 0)
+			{
+				FProcTreeIndexRange NewRange;
+				NewRange.FirstIndex = InstanceIdx * NumCardIndices;
+				NewRange.BaseVertex = InstanceIdx * NumCardVerts;
+				Expanded.IndexRanges.Add(NewRange);
+			}
+			FProcTreeIndexRange& Range = Expanded.IndexRanges.Last();
+			const int32 VertBase = InstanceIdx * NumCardVerts - Range.BaseVertex;
+			for (int32 Index = 0; Index < NumCardIndices; Index++)
+			{
+				Expanded.IndexBuffer16[InstanceIdx * NumCardIndices + Index] = (uint16)(Card.GetIndex(Index) + VertBase);
+			}
+			Range.NumIndices += NumCardIndices;
+			Range.NumVertices += NumCardVerts;
+		}
+	}
+	else
+	{
+		Expanded.IndexBuffer.SetNumUninitialized(NumCardIndices * NumInstances);
+		for (int32 InstanceIdx = 0; InstanceIdx < NumInstances; InstanceIdx++)
+		{
+			for (int32 Index = 0; Index < NumCardIndices; Index++)
+			{
+				Expanded.IndexBuffer[InstanceIdx * NumCardIndices + Index] = Card.GetIndex(Index) + InstanceIdx * NumCardVerts;
+			}
 		}
-
 	}
 
-	UpdateLocalBounds(); // Update overall bounds
-	UpdateCollision(); // Mark collision as dirty
-	MarkRenderStateDirty(); // New section requires recreating scene proxy
+	Expanded.bSectionVisible = Card.bSectionVisible;
 }
 
 
@@ -445,19 +961,19 @@ bool UProceduralTreeComponent::GetPhysicsTriMeshData(struct FTriMeshCollisionDat
 				// Copy UV if desired
 				if (bCopyUVs)
 				{
-					CollisionData->UVs[0].Add(Section.TextureCoordinates0[VertIdx]);
+					CollisionData->UVs[0].Add(Section.GetTextureCoordinate(VertIdx));
 				}
 			}
 
 			// Copy triangle data
-			const int32 NumTriangles = Section.IndexBuffer.Num() / 3;
+			const int32 NumTriangles = Section.GetNumIndices() / 3;
 			for (int32 TriIdx = 0; TriIdx < NumTriangles; TriIdx++)
 			{
 				// Need to add base offset for indices
 				FTriIndices Triangle;
-				Triangle.v0 = Section.IndexBuffer[(TriIdx * 3) + 0] + VertexBase;
-				Triangle.v1 = Section.IndexBuffer[(TriIdx * 3) + 1] + VertexBase;
-				Triangle.v2 = Section.IndexBuffer[(TriIdx * 3) + 2] + VertexBase;
+				Triangle.v0 = Section.GetIndex((TriIdx * 3) + 0) + VertexBase;
+				Triangle.v1 = Section.GetIndex((TriIdx * 3) + 1) + VertexBase;
+				Triangle.v2 = Section.GetIndex((TriIdx * 3) + 2) + VertexBase;
 				CollisionData->Indices.Add(Triangle);
 
 				// Also store material info
@@ -480,7 +996,7 @@ bool UProceduralTreeComponent::ContainsPhysicsTriMeshData(bool InUseAllTriData)
 {
 	for (const FProcTreeMeshSection& Section : TreeMeshSections)
 	{
-		if (Section.IndexBuffer.Num() >= 3 && Section.bEnableCollision)
+		if (Section.GetNumIndices() >= 3 && Section.bEnableCollision)
 		{
 			return true;
 		}
@@ -547,7 +1063,7 @@ UMaterialInterface* UProceduralTreeComponent::GetMaterialFromCollisionFaceIndex(
 		for (int32 SectionIdx = 0; SectionIdx < TreeMeshSections.Num(); SectionIdx++)
 		{
 			const FProcTreeMeshSection& Section = TreeMeshSections[SectionIdx];
-			int32 NumFaces = Section.IndexBuffer.Num() / 3;
+			int32 NumFaces = Section.GetNumIndices() / 3;
 			TotalFaceCount += NumFaces;
 
 			if (FaceIndex < TotalFaceCount)
@@ -26,6 +26,7 @@ ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
 SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 */
 #include "proctree.h"
+#include "Async/ParallelFor.h"
 
 
 
@@ -103,16 +104,19 @@ namespace Proctree
 		return add(aVector, change);
 	}
 
-	fvec3 vecAxisAngle(fvec3 aVec, fvec3 aAxis, float aAngle)
+	fvec3 axisRotate(fvec3 aVec, fvec3 aAxis, float aCos, float aSin)
 	{
 		//v std::cos(T) + (axis x v) * std::sin(T) + axis*(axis . v)(1-std::cos(T)
-		float cosr = FMath::Cos(aAngle);
-		float sinr = FMath::Sin(aAngle);
-		return add(add(scaleVec(aVec, cosr), scaleVec(cross(aAxis, aVec), sinr)), 
-			           scaleVec(aAxis, dot(aAxis, aVec) * (1 - cosr)));
+		return add(add(scaleVec(aVec, aCos), scaleVec(cross(aAxis, aVec), aSin)), 
+			           scaleVec(aAxis, dot(aAxis, aVec) * (1 - aCos)));
+	}
+
+	fvec3 vecAxisAngle(fvec3 aVec, fvec3 aAxis, float aAngle)
+	{
+		return axisRotate(aVec, aAxis, FMath::Cos(aAngle), FMath::Sin(aAngle));
 	}
 
-	fvec3 mirrorBranch(fvec3 aVec, fvec3 aNorm, Properties &aProperties)
+	fvec3 mirrorBranch(fvec3 aVec, fvec3 aNorm, const Properties &aProperties)
 	{
 		fvec3 v = cross(aNorm, cross(aVec, aNorm));
 		float s = aProperties.mBranchFactor * dot(v, aVec);
@@ -124,6 +128,89 @@ namespace Proctree
 		return res;
 	}
 
+	Arena::Arena(SIZE_T aBlockSize)
+	{
+		mFirst = 0;
+		mCurrent = 0;
+		mPtr = 0;
+		mEnd = 0;
+		mBlockSize = aBlockSize;
+	}
+
+	Arena::~Arena()
+	{
+		Block *block = mFirst;
+		while (block)
+		{
+			Block *next = block->mNext;
+			FMemory::Free(block);
+			block = next;
+		}
+	}
+
+	void Arena::nextBlock(SIZE_T aSize)
+	{
+		// Use the first unused block in the chain that is big enough, moving
+		// it right after the current block; only allocate when none is. This
+		// way a warmed up arena serves any allocation order without the heap.
+		Block **link = mCurrent ? &mCurrent->mNext : &mFirst;
+		Block **found = link;
+		while (*found && (*found)->mSize < aSize)
+		{
+			found = &(*found)->mNext;
+		}
+
+		Block *next = *found;
+		if (next)
+		{
+			*found = next->mNext;
+		}
+		else
+		{
+			SIZE_T size = FMath::Max(mBlockSize, aSize);
+			next = (Block*)FMemory::Malloc(sizeof(Block) + size, 16);
+			next->mSize = size;
+		}
+		next->mNext = *link;
+		*link = next;
+
+		mCurrent = next;
+		mPtr = (uint8*)(next + 1);
+		mEnd = mPtr + next->mSize;
+	}
+
+	void *Arena::alloc(SIZE_T aSize, SIZE_T aAlign)
+	{
+		uint8 *p = (uint8*)Align(mPtr, aAlign);
+		if (!mCurrent || p + aSize > mEnd)
+		{
+			nextBlock(aSize + aAlign);
+			p = (uint8*)Align(mPtr, aAlign);
+		}
+		mPtr = p + aSize;
+		return p;
+	}
+
+	void Arena::reset()
+	{
+		mCurrent = 0;
+		mPtr = 0;
+		mEnd = 0;
+	}
+
+	Arena::Marker Arena::mark() const
+	{
+		return { mCurrent, mPtr };
+	}
+
+	void Arena::rewind(const Marker &aMarker)
+	{
+		// Blocks past the marked one stay in the chain for nextBlock() to reuse
+		mCurrent = aMarker.mBlock;
+		mPtr = aMarker.mPtr;
+		mEnd = mCurrent ? (uint8*)(mCurrent + 1) + mCurrent->mSize : 0;
+	}
+
 	Properties::Properties(
 		float aClumpMax,
 		float aClumpMin,
@@ -150,6 +237,8 @@ namespace Proctree
 	{
 		mSeed = aSeed;
 		mSegments = aSegments;
+		mSegmentFalloff = 1;
+		mMinSegments = 4;
 		mLevels = aLevels;
 		mVMultiplier = aVMultiplier;
 		mTwigScale = aTwigScale;
@@ -170,12 +259,25 @@ namespace Proctree
 		mRadiusFalloffRate = aRadiusFalloffRate;
 		mTwistRate = aTwistRate;
 		mTrunkLength = aTrunkLength;
+		mRandomMode = RANDOM_LEGACY;
+		mAnalyticNormals = false;
+		mParallelLevel = 1;
+		mKeepSkeleton = false;
+		mTwigs = true;
+		mPruneOverlap = 0;
+		mTwigCullOcclusion = 0;
+		mOptimizeVertexCache = false;
+		mProgressiveOrder = false;
+		mTwigInstances = false;
+		mLevelsDropped = 0;
 	}
 
 	Properties::Properties()
 	{
 		mSeed = 262;
 		mSegments = 6;
+		mSegmentFalloff = 1;
+		mMinSegments = 4;
 		mLevels = 5;
 		mVMultiplier = 0.36f;
 		mTwigScale = 0.39f;
@@ -196,840 +298,3539 @@ namespace Proctree
 		mRadiusFalloffRate = 0.73f;
 		mTwistRate = 3.02f;
 		mTrunkLength = 2.4f;
+		mRandomMode = RANDOM_LEGACY;
+		mAnalyticNormals = false;
+		mParallelLevel = 1;
+		mKeepSkeleton = false;
+		mTwigs = true;
+		mPruneOverlap = 0;
+		mTwigCullOcclusion = 0;
+		mOptimizeVertexCache = false;
+		mProgressiveOrder = false;
+		mTwigInstances = false;
+		mLevelsDropped = 0;
 	}
 
-	float Properties::random(float aFixed)
+	float Properties::random(float aFixed, int32 &aCounter) const
 	{
 		if (!aFixed)
 		{
-			aFixed = (float)mRseed++;
+			aFixed = (float)aCounter++;
 		}
 		return FMath::Abs(FMath::Cos(aFixed + aFixed * aFixed));
 	}
 
-
-	Branch::~Branch()
-	{
-		delete mChild0;
-		delete mChild1;
-		delete[] mRootRing;
-		delete[] mRing0;
-		delete[] mRing1;
-		delete[] mRing2;
-	}
-
-	Branch::Branch()
+	static FORCEINLINE uint64 splitMix(uint64 x)
 	{
-		mRootRing = 0;
-		mRing0 = 0;
-		mRing1 = 0;
-		mRing2 = 0;
-		mChild0 = 0;
-		mChild1 = 0;
-		mParent = 0;
-		mLength = 1;
-		mTrunktype = 0;
-		mRadius = 0;
-		mHead = { 0, 0, 0 };
-		mTangent = { 0, 0, 0 };
-		mEnd = 0;
+		x += 0x9E3779B97F4A7C15ull;
+		x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ull;
+		x = (x ^ (x >> 27)) * 0x94D049BB133111EBull;
+		return x ^ (x >> 31);
 	}
 
-	Branch::Branch(fvec3 aHead, Branch *aParent)
+	float Properties::hashRandom(int32 aLevel, int32 aIndex) const
 	{
-		mRootRing = 0;
-		mRing0 = 0;
-		mRing1 = 0;
-		mRing2 = 0;
-		mChild0 = 0;
-		mChild1 = 0;
-		mLength = 1;
-		mTrunktype = 0;
-		mRadius = 0;
-		mHead = aHead;
-		mTangent = { 0, 0, 0 };
-		mParent = aParent;
-		mEnd = 0;
+		// A branch's index inside its level block spells out its path from the
+		// trunk, so seed, level and index name every branch uniquely
+		uint64 h = splitMix(((uint64)(uint32)mSeed << 32) | (uint32)aLevel);
+		h = splitMix(h ^ (uint32)aIndex);
+		return (float)(h >> 40) * (1.0f / 16777216.0f);
 	}
 
-	void Branch::split(int32 aLevel, int32 aSteps, Properties &aProperties, int32 aL1/* = 1*/, int32 aL2/* = 1*/)
+	int32 Properties::levelSegments(int32 aLevel) const
 	{
-		int32 rLevel = aProperties.mLevels - aLevel;
-		fvec3 po;
-		if (this->mParent)
-		{
-			po = mParent->mHead;
-		}
-		else
+		// Thinner levels need fewer segments to look round. Counts stay even
+		// since a fork splits its ring in two halves, and never go past the
+		// trunk's.
+		if (aLevel == 0 || mSegmentFalloff >= 1)
 		{
-			po = { 0, 0, 0 };
-			mTrunktype = 1;
+			return mSegments;
 		}
-		fvec3 so = mHead;
-		fvec3 dir = normalize(sub(so, po));
-
-		fvec3 a = { dir.z, dir.x, dir.y };
-		fvec3 normal = cross(dir, a);
-		fvec3 tangent = cross(dir, normal);
-		float r = aProperties.random(rLevel * 10 + aL1 * 5.0f + aL2 + aProperties.mSeed);
-		//float r2 = aProperties.random(rLevel * 10 + aL1 * 5.0f + aL2 + 1 + aProperties.seed); // never used
-
-		fvec3 adj = add(scaleVec(normal, r), scaleVec(tangent, 1 - r));
-		if (r > 0.5) adj = scaleVec(adj, -1);
-
-		float clump = (aProperties.mClumpMax - aProperties.mClumpMin) * r + aProperties.mClumpMin;
-		fvec3 newdir = normalize(add(scaleVec(adj, 1 - clump), scaleVec(dir, clump)));
-
+		int32 segments = 2 * FMath::RoundToInt(mSegments * 0.5f * FMath::Pow(mSegmentFalloff, (float)aLevel));
+		return FMath::Min(mSegments, FMath::Max(segments, mMinSegments));
+	}
 
-		fvec3 newdir2 = mirrorBranch(newdir, dir, aProperties);
-		if (r > 0.5)
-		{
-			fvec3 tmp = newdir;
-			newdir = newdir2;
-			newdir2 = tmp;
-		}
 
-		if (aSteps > 0)
+	// Calls aBody for every index in [aBegin, aEnd), spread over worker threads
+	// when aParallel is set. The calls must not depend on each other.
+	template <typename Body>
+	static void forRange(int32 aBegin, int32 aEnd, bool aParallel, const Body &aBody)
+	{
+		if (aParallel)
 		{
-			float angle = aSteps / (float)aProperties.mTreeSteps * 2 * M_PI * aProperties.mTwistRate;
-			a = { FMath::Sin(angle), r, FMath::Cos(angle) };
-			newdir2 = normalize(a);
+			ParallelFor(aEnd - aBegin, [&](int32 aIndex)
+			{
+				aBody(aBegin + aIndex);
+			});
+			return;
 		}
-
-		float growAmount = aLevel * aLevel / (float)(aProperties.mLevels * aProperties.mLevels) * aProperties.mGrowAmount;
-		float dropAmount = rLevel * aProperties.mDropAmount;
-		float sweepAmount = rLevel * aProperties.mSweepAmount;
-		a = { sweepAmount, dropAmount + growAmount, 0 };
-		newdir = normalize(add(newdir, a));
-		newdir2 = normalize(add(newdir2, a));
-
-		fvec3 head0 = add(so, scaleVec(newdir, mLength));
-		fvec3 head1 = add(so, scaleVec(newdir2, mLength));
-		mChild0 = new Branch(head0, this);
-		mChild1 = new Branch(head1, this);
-		mChild0->mLength = pow(mLength, aProperties.mLengthFalloffPower) * aProperties.mLengthFalloffFactor;
-		mChild1->mLength = pow(mLength, aProperties.mLengthFalloffPower) * aProperties.mLengthFalloffFactor;
-
-		if (aLevel > 0)
+		int32 i;
+		for (i = aBegin; i < aEnd; i++)
 		{
-			if (aSteps > 0)
-			{
-				a = {
-					(r - 0.5f) * 2 * aProperties.mTrunkKink,
-					aProperties.mClimbRate,
-					(r - 0.5f) * 2 * aProperties.mTrunkKink
-				};
-				mChild0->mHead = add(mHead, a);
-				mChild0->mTrunktype = 1;
-				mChild0->mLength = mLength * aProperties.mTaperRate;
-				mChild0->split(aLevel, aSteps - 1, aProperties, aL1 + 1, aL2);
-			}
-			else
-			{
-				mChild0->split(aLevel - 1, 0, aProperties, aL1 + 1, aL2);
-			}
-			mChild1->split(aLevel - 1, 0, aProperties, aL1, aL2 + 1);
+			aBody(i);
 		}
 	}
 
 
-	Tree::Tree()
+	static FORCEINLINE bool isParallel(int32 aParallelLevel, int32 aLevel)
 	{
-		mRoot = 0;
-		mVert = 0;
-		mNormal = 0;
-		mUV = 0;
-		mTwigVert = 0;
-		mTwigNormal = 0;
-		mTwigUV = 0;
-		mFace = 0;
-		mTwigFace = 0;
-
-		mVertCount = 0;
-		mTwigVertCount = 0;
-		mFaceCount = 0;
-		mTwigFaceCount = 0;
+		return aParallelLevel >= 0 && aLevel >= aParallelLevel;
 	}
 
-	Tree::~Tree()
-	{
-		delete[] mRoot;
-		delete[] mVert;
-		delete[] mNormal;
-		delete[] mUV;
-		delete[] mTwigVert;
-		delete[] mTwigNormal;
-		delete[] mTwigUV;
-		delete[] mFace;
-		delete[] mTwigFace;
-	}
 
-	void Tree::init()
+	static FORCEINLINE float fallLength(float aLength, const Properties &aProperties)
 	{
-		mVertCount = 0;
-		mTwigVertCount = 0;
-		mFaceCount = 0;
-		mTwigFaceCount = 0;
-
-		delete[] mRoot;
-		delete[] mVert;
-		delete[] mNormal;
-		delete[] mUV;
-		delete[] mTwigVert;
-		delete[] mTwigNormal;
-		delete[] mTwigUV;
-		delete[] mFace;
-		delete[] mTwigFace;
-
-		mRoot = 0;
-		mVert = 0;
-		mNormal = 0;
-		mUV = 0;
-		mTwigVert = 0;
-		mTwigNormal = 0;
-		mTwigUV = 0;
-		mFace = 0;
-		mTwigFace = 0;
+		return pow(aLength, aProperties.mLengthFalloffPower) * aProperties.mLengthFalloffFactor;
 	}
 
-	void Tree::allocVertBuffers()
-	{
-		mVert = new fvec3[mVertCount];
-		mNormal = new fvec3[mVertCount];
-		mUV = new fvec2[mVertCount];
-		mTwigVert = new fvec3[mTwigVertCount];
-		mTwigNormal = new fvec3[mTwigVertCount];
-		mTwigUV = new fvec2[mTwigVertCount];
-		mTwigFace = new ivec3[mTwigFaceCount];
-
-		// Reset back to zero, we'll use these as counters
 
-		mVertCount = 0;
-		mTwigVertCount = 0;
-		mTwigFaceCount = 0;
+	static int32 forkVertCount(int32 aSegments)
+	{
+		// linch0, first half arc, linch1, second half arc, third arc
+		return
+			1 +
+			(aSegments / 2) - 1 +
+			1 +
+			(aSegments / 2) - 1 +
+			(aSegments / 2) - 1;
 	}
 
-	void Tree::allocFaceBuffers()
+	SIZE_T TreeSize::getAllocatedSize() const
 	{
-		mFace = new ivec3[mFaceCount];
+		SIZE_T verts = (SIZE_T)mVertCount + mSeamVertCount;
+		return
+			verts * (sizeof(fvec3) * 2 + sizeof(fvec4) + sizeof(fvec2)) +
+			(SIZE_T)mFaceCount * sizeof(ivec3) +
+			(mTwigInstanceCount > 0 ? (SIZE_T)mTwigInstanceCount * sizeof(TwigInstance) :
+				(SIZE_T)mTwigVertCount * (sizeof(fvec3) * 2 + sizeof(fvec4) + sizeof(fvec2)) +
+				(SIZE_T)mTwigFaceCount * sizeof(ivec3));
+	}
 
-		// Reset back to zero, we'll use these as counters
 
-		mFaceCount = 0;
+	Skeleton::Skeleton()
+	{
+		mCount = 0;
+		mLevelCount = 0;
+		mRseed = 0;
+		mLevelStart = 0;
+		mLevelOffset = 0;
+		mRandom = 0;
+		mRandomCount = 0;
+		mChildLength = 0;
+		mOriginCount = 0;
+		mHead = 0;
+		mTangent = 0;
+		mLength = 0;
+		mRadius = 0;
+		mTrunktype = 0;
+		mLevel = 0;
+		mSteps = 0;
+		mL1 = 0;
+		mL2 = 0;
+		mParent = 0;
+		mChild0 = 0;
+		mChild1 = 0;
+		mPruned = 0;
+		mTwigCulled = 0;
+		mBarkLevels = 0;
+		mLevelVertBase = 0;
+		mLevelFaceBase = 0;
+		mLevelSegments = 0;
+		mLevelVertStride = 0;
+		mLevelFaceStride = 0;
+		mTwigOrigin = 0;
 	}
 
-	void Tree::generate()
+	int32 Skeleton::levelSize(int32 aLevel, int32 aLevels, int32 aTreeSteps)
 	{
-		init();
-		mProperties.mRseed = mProperties.mSeed;
-		fvec3 starthead = { 0, mProperties.mTrunkLength, 0 };
-		mRoot = new Branch(starthead, 0);
-		mRoot->mLength = mProperties.mInitialBranchLength;
-		mRoot->split(mProperties.mLevels, mProperties.mTreeSteps, mProperties);
-
-		calcVertSizes(0);
-		allocVertBuffers();
-		createForks(0, 0);
-		createTwigs(0);
-		calcFaceSizes(0);
-		allocFaceBuffers();
-		doFaces(0);
-		calcNormals();
-		fixUVs();
-		delete mRoot;
-		mRoot = 0;
+		// The trunk is a chain of aTreeSteps + 1 forks. Every trunk fork sheds one
+		// level 1 branch, except the last one which sheds two, and from there on
+		// each branch forks in two until the leaves.
+		if (aLevels <= 0)
+		{
+			return aLevel == 0 ? 1 : 2;
+		}
+		if (aLevel == 0)
+		{
+			return aTreeSteps + 1;
+		}
+		return (aTreeSteps + 2) << (aLevel - 1);
 	}
 
-	void Tree::fixUVs()
+	void Skeleton::grow(const Properties &aProperties, Arena &aArena)
 	{
-		// There'll never be more than 50% bad vertices
-		int32 *badverttable = new int[mVertCount / 2];
+		int32 levels = FMath::Max(aProperties.mLevels, 0);
 		int32 i;
-		int32 badverts = 0;
-
-		// step 1: find bad verts
-		// - If edge's U coordinate delta is over 0.5, texture has wrapped around. 
-		// - The vertex that has zero U is the wrong one
-		// - Care needs to be taken not to tag bad vertex more than once.
 
-		for (i = 0; i < mFaceCount; i++)
+		mLevelCount = levels + 2;
+		mRseed = aProperties.mSeed;
+		mLevelStart = aArena.alloc<int32>(mLevelCount + 1);
+		mCount = 0;
+		for (i = 0; i < mLevelCount; i++)
 		{
-			// x/y edges (vertex 0 and 1)
-			if ((FMath::Abs(mUV[mFace[i].x].u - mUV[mFace[i].y].u) > 0.5f) && (mUV[mFace[i].x].u == 0 || mUV[mFace[i].y].u == 0))
-			{
-				int32 found = 0, j;
-				for (j = 0; j < badverts; j++)
-				{
-					if (badverttable[j] == mFace[i].y && mUV[mFace[i].y].u == 0)
-						found = 1;
-					if (badverttable[j] == mFace[i].x && mUV[mFace[i].x].u == 0)
-						found = 1;
-				}
-				if (!found)
-				{
-					if (mUV[mFace[i].x].u == 0)
-						badverttable[badverts] = mFace[i].x;
-					if (mUV[mFace[i].y].u == 0)
-						badverttable[badverts] = mFace[i].y;
-					badverts++;
-				}
-			}
+			mLevelStart[i] = mCount;
+			mCount += levelSize(i, levels, aProperties.mTreeSteps);
+		}
+		mLevelStart[mLevelCount] = mCount;
+		mTwigOrigin = mLevelStart[mLevelCount - 1];
+		mBarkLevels = mLevelCount;
+		layout(aProperties, aArena);
+
+		mHead = aArena.alloc<fvec3>(mCount);
+		mTangent = aArena.alloc<fvec3>(mCount);
+		mLength = aArena.alloc<float>(mCount);
+		mRadius = aArena.alloc<float>(mCount);
+		mTrunktype = aArena.alloc<int32>(mCount);
+		mLevel = aArena.alloc<int32>(mCount);
+		mSteps = aArena.alloc<int32>(mCount);
+		mL1 = aArena.alloc<int32>(mCount);
+		mL2 = aArena.alloc<int32>(mCount);
+		mParent = aArena.alloc<int32>(mCount);
+		mChild0 = aArena.alloc<int32>(mCount);
+		mChild1 = aArena.alloc<int32>(mCount);
+
+		mHead[0] = { 0, aProperties.mTrunkLength, 0 };
+		mTangent[0] = { 0, 0, 0 };
+		mLength[0] = aProperties.mInitialBranchLength;
+		mTrunktype[0] = 1;
+		mLevel[0] = 0;
+		mSteps[0] = aProperties.mTreeSteps;
+		mL1[0] = 1;
+		mL2[0] = 1;
+		mParent[0] = -1;
+
+		// The trunk chain appends its next fork to its own level, so level 0 is
+		// split in order. Its children fill the level 1 block in parent order.
+		initLevelTables(aProperties, aArena);
+
+		int32 trunkCursor = 1;
+		int32 cursor = mLevelStart[1];
+		for (i = 0; i < mLevelStart[1]; i++)
+		{
+			int32 child0 = extendsTrunk(i, aProperties) ? trunkCursor++ : cursor++;
+			split(i, child0, cursor++, aProperties);
+		}
 
-			// x/z edges (vertex 0 and 2)
-			if ((FMath::Abs(mUV[mFace[i].x].u - mUV[mFace[i].z].u) > 0.5f) && (mUV[mFace[i].x].u == 0 || mUV[mFace[i].z].u == 0))
+		// Every branch that left the trunk at the same fork has the same
+		// length at a given level. The level 1 block holds one branch per such
+		// fork, in order, so it seeds the table.
+		int32 level;
+		for (level = 1; level < mLevelCount - 1; level++)
+		{
+			int32 origin;
+			for (origin = 0; origin < mOriginCount; origin++)
 			{
-				int32 found = 0, j;
-				for (j = 0; j < badverts; j++)
-				{
-					if (badverttable[j] == mFace[i].z && mUV[mFace[i].z].u == 0)
-						found = 1;
-					if (badverttable[j] == mFace[i].x && mUV[mFace[i].x].u == 0)
-						found = 1;
-				}
-				if (!found)
-				{
-					if (mUV[mFace[i].x].u == 0)
-						badverttable[badverts] = mFace[i].x;
-					if (mUV[mFace[i].z].u == 0)
-						badverttable[badverts] = mFace[i].z;
-					badverts++;
-				}
+				float length = level == 1 ? mLength[mLevelStart[1] + origin] : mChildLength[(level - 2) * mOriginCount + origin];
+				mChildLength[(level - 1) * mOriginCount + origin] = fallLength(length, aProperties);
 			}
+		}
 
-			// y/z edges (vertex 1 and 2)
-			if ((FMath::Abs(mUV[mFace[i].y].u - mUV[mFace[i].z].u) > 0.5f) && (mUV[mFace[i].y].u == 0 || mUV[mFace[i].z].u == 0))
+		// Past the trunk every branch forks in two, so its children sit at a
+		// fixed place in the next block and a whole level can split at once.
+		for (level = 1; level < mLevelCount - 1; level++)
+		{
+			// Legacy random() falls back to the shared counter when its argument
+			// is 0, which only negative seeds can reach; such levels stay serial
+			// so the counter advances in the same order.
+			bool parallel = isParallel(aProperties.mParallelLevel, level) &&
+				(aProperties.mRandomMode != RANDOM_LEGACY || aProperties.mSeed + level * 10 + 6 > 0);
+			int32 start = mLevelStart[level];
+			int32 childStart = mLevelStart[level + 1];
+			forRange(start, mLevelStart[level + 1], parallel, [&](int32 aBranch)
 			{
-				int32 found = 0, j;
-				for (j = 0; j < badverts; j++)
-				{
-					if (badverttable[j] == mFace[i].z && mUV[mFace[i].z].u == 0)
-						found = 1;
-					if (badverttable[j] == mFace[i].y && mUV[mFace[i].y].u == 0)
-						found = 1;
-				}
-				if (!found)
-				{
-					if (mUV[mFace[i].y].u == 0)
-						badverttable[badverts] = mFace[i].y;
-					if (mUV[mFace[i].z].u == 0)
-						badverttable[badverts] = mFace[i].z;
-					badverts++;
-				}
-			}
+				int32 child = childStart + (aBranch - start) * 2;
+				split(aBranch, child, child + 1, aProperties);
+			});
+		}
+		for (i = mLevelStart[mLevelCount - 1]; i < mCount; i++)
+		{
+			mChild0[i] = -1;
+			mChild1[i] = -1;
 		}
-		
-		// step 2: allocate more space for our new duplicate verts
-
-		fvec3 *nvert = new fvec3[mVertCount + badverts];
-		memcpy(nvert, mVert, sizeof(fvec3) * mVertCount);
-		delete[] mVert;
-		mVert = nvert;
-
-		fvec3 *nnorm = new fvec3[mVertCount + badverts];
-		memcpy(nnorm, mNormal, sizeof(fvec3) * mVertCount);
-		delete[] mNormal;
-		mNormal = nnorm;
 
-		fvec2 *nuv = new fvec2[mVertCount + badverts];
-		memcpy(nuv, mUV, sizeof(fvec2) * mVertCount);
-		delete[] mUV;
-		mUV = nuv;
+		flowRadii(aProperties);
+	}
 
-		// step 3: populate duplicate verts - otherwise identical except for U=1 instead of 0
-		
-		for (i = 0; i < badverts; i++)
+	void Skeleton::flowRadii(const Properties &aProperties)
+	{
+		// A fork is never thicker than it is long, and its children start from
+		// that capped radius: the trunk tapers, everything else falls off
+		mRadius[0] = aProperties.mMaxRadius;
+		int32 i;
+		for (i = 0; i < mLevelStart[mLevelCount - 1]; i++)
 		{
-			mVert[mVertCount + i] = mVert[badverttable[i]];
-			mNormal[mVertCount + i] = mNormal[badverttable[i]];
-			mUV[mVertCount + i] = mUV[badverttable[i]];
-			mUV[mVertCount + i].u = 1.0f;
+			float radius = mRadius[i];
+			if (radius > mLength[i]) radius = mLength[i];
+			int32 child0 = mChild0[i];
+			mRadius[child0] = radius * (mTrunktype[child0] ? aProperties.mTaperRate : aProperties.mRadiusFalloffRate);
+			mRadius[mChild1[i]] = radius * aProperties.mRadiusFalloffRate;
 		}
+	}
 
-		// step 4: fix faces
-		
-		for (i = 0; i < mFaceCount; i++)
+	// Closest distance between the segments [aP1, aQ1] and [aP2, aQ2]
+	static float segmentDistance(fvec3 aP1, fvec3 aQ1, fvec3 aP2, fvec3 aQ2)
+	{
+		fvec3 d1 = sub(aQ1, aP1);
+		fvec3 d2 = sub(aQ2, aP2);
+		fvec3 r = sub(aP1, aP2);
+		float a = dot(d1, d1);
+		float e = dot(d2, d2);
+		float c = dot(d1, r);
+		float f = dot(d2, r);
+		float s = 0;
+		float t = 0;
+		if (a > 1e-12f && e > 1e-12f)
 		{
-			// x/y edges (vertex 0 and 1)
-			if ((FMath::Abs(mUV[mFace[i].x].u - mUV[mFace[i].y].u) > 0.5f) && (mUV[mFace[i].x].u == 0 || mUV[mFace[i].y].u == 0))
-			{				
-				int32 found = 0, j;
-				for (j = 0; j < badverts; j++)
-				{
-					if (badverttable[j] == mFace[i].y && mUV[mFace[i].y].u == 0)
-						found = j;
-					if (badverttable[j] == mFace[i].x && mUV[mFace[i].x].u == 0)
-						found = j;
-				}
-				if (mUV[mFace[i].y].u == 0)
-					mFace[i].y = mVertCount + found;
-				if (mUV[mFace[i].x].u == 0)
-					mFace[i].x = mVertCount + found;
+			float b = dot(d1, d2);
+			float denom = a * e - b * b;
+			s = denom > 0 ? FMath::Clamp((b * f - c * e) / denom, 0.0f, 1.0f) : 0;
+			t = (b * s + f) / e;
+			if (t < 0)
+			{
+				t = 0;
+				s = FMath::Clamp(-c / a, 0.0f, 1.0f);
 			}
-
-			// x/z edges (vertex 0 and 2)
-			if ((FMath::Abs(mUV[mFace[i].x].u - mUV[mFace[i].z].u) > 0.5f) && (mUV[mFace[i].x].u == 0 || mUV[mFace[i].z].u == 0))
+			else if (t > 1)
 			{
-				int32 found = 0, j;
-				for (j = 0; j < badverts; j++)
-				{
-					if (badverttable[j] == mFace[i].z && mUV[mFace[i].z].u == 0)
-						found = j;
-					if (badverttable[j] == mFace[i].x && mUV[mFace[i].x].u == 0)
-						found = j;
-				}
-				if (mUV[mFace[i].x].u == 0)
-					mFace[i].x = mVertCount + found;
-				if (mUV[mFace[i].z].u == 0)
-					mFace[i].z = mVertCount + found;
+				t = 1;
+				s = FMath::Clamp((b - c) / a, 0.0f, 1.0f);
 			}
+		}
+		else if (a > 1e-12f)
+		{
+			s = FMath::Clamp(-c / a, 0.0f, 1.0f);
+		}
+		else if (e > 1e-12f)
+		{
+			t = FMath::Clamp(f / e, 0.0f, 1.0f);
+		}
+		return length(sub(add(aP1, scaleVec(d1, s)), add(aP2, scaleVec(d2, t))));
+	}
+
+	static FORCEINLINE uint32 cellHash(int32 x, int32 y, int32 z)
+	{
+		return ((uint32)x * 73856093u) ^ ((uint32)y * 19349663u) ^ ((uint32)z * 83492791u);
+	}
 
-			// y/z edges (vertex 1 and 2)
-			if ((FMath::Abs(mUV[mFace[i].y].u - mUV[mFace[i].z].u) > 0.5f) && (mUV[mFace[i].y].u == 0 || mUV[mFace[i].z].u == 0))
+	// Calls aBody with the hash of every grid cell in [aMin, aMax]
+	template <typename Body>
+	static void forEachCell(ivec3 aMin, ivec3 aMax, const Body &aBody)
+	{
+		int32 x, y, z;
+		for (x = aMin.x; x <= aMax.x; x++)
+		{
+			for (y = aMin.y; y <= aMax.y; y++)
 			{
-				int32 found = 0, j;
-				for (j = 0; j < badverts; j++)
+				for (z = aMin.z; z <= aMax.z; z++)
 				{
-					if (badverttable[j] == mFace[i].z && mUV[mFace[i].z].u == 0)
-						found = j;
-					if (badverttable[j] == mFace[i].y && mUV[mFace[i].y].u == 0)
-						found = j;
+					aBody(cellHash(x, y, z));
 				}
-				if (mUV[mFace[i].y].u == 0)
-					mFace[i].y = mVertCount + found;
-				if (mUV[mFace[i].z].u == 0)
-					mFace[i].z = mVertCount + found;				
 			}
 		}
-
-		// step 5: update vert count
-		mVertCount += badverts;
-
-		// and cleanup
-		delete[] badverttable;
 	}
 
-	void Tree::calcVertSizes(Branch *aBranch)
+	void Skeleton::prune(const Properties &aProperties, Arena &aArena)
 	{
-		int32 segments = mProperties.mSegments;
-		if (!aBranch)
-			aBranch = mRoot;
-
-		if (!aBranch->mParent)
+		// Every branch is a capsule of bark from its parent's head to its own,
+		// as thick as the branch. Twig cards are left out: they fill the
+		// crown, so nearly every leaf would touch a card of its uncle or
+		// cousins. Capsules start past the parent's radius since a branch
+		// always grows out of its parent's tube.
+		fvec3 *start = aArena.alloc<fvec3>(mCount);
+		fvec3 *end = aArena.alloc<fvec3>(mCount);
+		float *radius = aArena.alloc<float>(mCount);
+		float cellSize = 0;
+		int32 i;
+		for (i = 0; i < mCount; i++)
 		{
-			mVertCount += segments;
+			int32 parent = mParent[i];
+			fvec3 from = parent >= 0 ? mHead[parent] : fvec3{ 0, 0, 0 };
+			fvec3 dir = normalize(sub(mHead[i], from));
+			float trim = parent >= 0 ? FMath::Min(mRadius[parent], mLength[parent]) : 0;
+			end[i] = mHead[i];
+			radius[i] = FMath::Min(mRadius[i], mLength[i]);
+			start[i] = add(from, scaleVec(dir, FMath::Min(trim, length(sub(end[i], from)))));
+			cellSize += length(sub(end[i], start[i])) + radius[i] * 2;
 		}
 
-		if (aBranch->mChild0)
+		// Uniform grid, hashed into a table of per-cell lists. Cells are about
+		// the size of an average capsule; a capsule is listed in every cell its
+		// bounds touch. Hash collisions only add candidates the distance test
+		// rejects.
+		cellSize = FMath::Max(cellSize / mCount, 1e-3f);
+		float invCell = 1.0f / cellSize;
+		ivec3 *cellMin = aArena.alloc<ivec3>(mCount);
+		ivec3 *cellMax = aArena.alloc<ivec3>(mCount);
+		int32 entryCapacity = 0;
+		for (i = 0; i < mCount; i++)
 		{
-			mVertCount +=
-				1 +
-				(segments / 2) - 1 +
-				1 +
-				(segments / 2) - 1 +
-				(segments / 2) - 1;
-
-			calcVertSizes(aBranch->mChild0);
-			calcVertSizes(aBranch->mChild1);
+			float r = radius[i];
+			cellMin[i] = {
+				FMath::FloorToInt((FMath::Min(start[i].x, end[i].x) - r) * invCell),
+				FMath::FloorToInt((FMath::Min(start[i].y, end[i].y) - r) * invCell),
+				FMath::FloorToInt((FMath::Min(start[i].z, end[i].z) - r) * invCell) };
+			cellMax[i] = {
+				FMath::FloorToInt((FMath::Max(start[i].x, end[i].x) + r) * invCell),
+				FMath::FloorToInt((FMath::Max(start[i].y, end[i].y) + r) * invCell),
+				FMath::FloorToInt((FMath::Max(start[i].z, end[i].z) + r) * invCell) };
+			entryCapacity +=
+				(cellMax[i].x - cellMin[i].x + 1) *
+				(cellMax[i].y - cellMin[i].y + 1) *
+				(cellMax[i].z - cellMin[i].z + 1);
 		}
-		else
+		int32 tableSize = 1;
+		while (tableSize < mCount * 2)
 		{
-			mVertCount++;
-			mTwigVertCount += 8;
-			mTwigFaceCount += 4;
+			tableSize <<= 1;
 		}
-	}
-
-	void Tree::calcFaceSizes(Branch *aBranch)
-	{
-		int32 segments = mProperties.mSegments;
-		if (!aBranch)
-			aBranch = mRoot;
-
-		if (!aBranch->mParent)
+		int32 *cellHead = aArena.alloc<int32>(tableSize);
+		int32 *entryNext = aArena.alloc<int32>(entryCapacity);
+		int32 *entryBranch = aArena.alloc<int32>(entryCapacity);
+		int32 *seen = aArena.alloc<int32>(mCount);
+		int32 entryCount = 0;
+		for (i = 0; i < tableSize; i++)
 		{
-			mFaceCount += segments * 2;
+			cellHead[i] = -1;
 		}
-
-		if (aBranch->mChild0->mRing0 != 0)
+		for (i = 0; i < mCount; i++)
 		{
-			mFaceCount += segments * 4;
-
-			calcFaceSizes(aBranch->mChild0);
-			calcFaceSizes(aBranch->mChild1);
+			seen[i] = -1;
 		}
-		else
+
+		// Branches come in level order, so thick branches claim their space
+		// before the thinner ones that grow into it. The trunk is always kept.
+		// A small mPruneOverlap only drops branches buried deep in another,
+		// 1 drops every branch that touches one.
+		float limitShare = 1 - FMath::Clamp(aProperties.mPruneOverlap, 0.0f, 1.0f);
+		mPruned = aArena.alloc<uint8>(mCount);
+		for (i = 0; i < mCount; i++)
 		{
-			mFaceCount += segments * 2;
+			int32 parent = mParent[i];
+			mPruned[i] = 0;
+			if (parent >= 0 && mPruned[parent])
+			{
+				mPruned[i] = 1;
+				continue;
+			}
+
+			// Its parent and sibling start where it does, so they always touch
+			if (mLevel[i] > 0)
+			{
+				int32 sibling = mChild0[parent] == i ? mChild1[parent] : mChild0[parent];
+				float limit = limitShare * radius[i] * 2;
+				forEachCell(cellMin[i], cellMax[i], [&](uint32 aCell)
+				{
+					int32 entry;
+					for (entry = cellHead[aCell & (tableSize - 1)]; entry >= 0 && !mPruned[i]; entry = entryNext[entry])
+					{
+						int32 other = entryBranch[entry];
+						if (seen[other] == i || other == parent || other == sibling)
+						{
+							continue;
+						}
+						seen[other] = i;
+						float overlap = radius[i] + radius[other] - segmentDistance(start[i], end[i], start[other], end[other]);
+						mPruned[i] = overlap >= limit;
+					}
+				});
+				if (mPruned[i])
+				{
+					continue;
+				}
+			}
+
+			forEachCell(cellMin[i], cellMax[i], [&](uint32 aCell)
+			{
+				int32 &head = cellHead[aCell & (tableSize - 1)];
+				entryBranch[entryCount] = i;
+				entryNext[entryCount] = head;
+				head = entryCount++;
+			});
 		}
 	}
 
-	void Tree::calcNormals()
+	void Skeleton::cullTwigs(const Properties &aProperties, Arena &aArena)
 	{
-		int32 *normalCount = new int[mVertCount];
-		memset(normalCount, 0, sizeof(int) * mVertCount);
-		memset(mNormal, 0, sizeof(fvec3) * mVertCount);
-
+		// Twig cards are binned by their center into a grid of card-sized
+		// voxels, and each twig counts how many of the 26 grid directions out
+		// of its voxel run into another occupied voxel. Only twigs blocked
+		// along all six axes are touched: one blocked in every direction is
+		// culled, and one blocked in mTwigCullOcclusion of them is thinned
+		// unless it is the first twig of its voxel. Voxels on the outer shell
+		// of the crown along an axis keep all their twigs, so the crown keeps
+		// its outline along the axes to within a card, the voxel size.
+		int32 leafStart = mLevelStart[mLevelCount - 1];
+		int32 leafCount = mCount - leafStart;
+		fvec3 *center = aArena.alloc<fvec3>(leafCount);
+		fvec3 boundsMin = { FLT_MAX, FLT_MAX, FLT_MAX };
+		fvec3 boundsMax = { -FLT_MAX, -FLT_MAX, -FLT_MAX };
 		int32 i;
-		for (i = 0; i < (int)mFaceCount; i++)
+		for (i = 0; i < leafCount; i++)
 		{
-			normalCount[mFace[i].x]++;
+			int32 leaf = leafStart + i;
+			fvec3 from = mHead[mParent[leaf]];
+			fvec3 c = add(from, scaleVec(normalize(sub(mHead[leaf], from)), aProperties.mTwigScale));
+			center[i] = c;
+			if (pruned(leaf))
+			{
+				continue;
+			}
+			boundsMin = { FMath::Min(boundsMin.x, c.x), FMath::Min(boundsMin.y, c.y), FMath::Min(boundsMin.z, c.z) };
+			boundsMax = { FMath::Max(boundsMax.x, c.x), FMath::Max(boundsMax.y, c.y), FMath::Max(boundsMax.z, c.z) };
+		}
+		if (boundsMin.x > boundsMax.x)
+		{
+			return;
+		}
+
+		// Past 128 voxels a side the voxels grow instead
+		fvec3 extent = sub(boundsMax, boundsMin);
+		float voxel = FMath::Max(aProperties.mTwigScale * 2, FMath::Max(extent.x, FMath::Max(extent.y, extent.z)) / 127);
+		voxel = FMath::Max(voxel, 1e-3f);
+		ivec3 size = {
+			FMath::FloorToInt(extent.x / voxel) + 1,
+			FMath::FloorToInt(extent.y / voxel) + 1,
+			FMath::FloorToInt(extent.z / voxel) + 1 };
+		int32 *keeper = aArena.alloc<int32>(size.x * size.y * size.z);
+		memset(keeper, -1, sizeof(int32) * size.x * size.y * size.z);
+		ivec3 *cell = aArena.alloc<ivec3>(leafCount);
+		for (i = 0; i < leafCount; i++)
+		{
+			fvec3 offset = sub(center[i], boundsMin);
+			cell[i] = {
+				FMath::Clamp(FMath::FloorToInt(offset.x / voxel), 0, size.x - 1),
+				FMath::Clamp(FMath::FloorToInt(offset.y / voxel), 0, size.y - 1),
+				FMath::Clamp(FMath::FloorToInt(offset.z / voxel), 0, size.z - 1) };
+			int32 &first = keeper[(cell[i].z * size.y + cell[i].y) * size.x + cell[i].x];
+			if (first < 0 && !pruned(leafStart + i))
+			{
+				first = leafStart + i;
+			}
+		}
+
+		mTwigCulled = aArena.alloc<uint8>(mCount);
+		memset(mTwigCulled, 0, mCount);
+		int32 thinned = FMath::CeilToInt(aProperties.mTwigCullOcclusion * 26);
+		forRange(leafStart, mCount, isParallel(aProperties.mParallelLevel, mLevelCount - 1), [&](int32 aLeaf)
+		{
+			if (pruned(aLeaf))
+			{
+				return;
+			}
+			ivec3 from = cell[aLeaf - leafStart];
+			int32 blocked = 0;
+			int32 axesBlocked = 0;
+			int32 dx, dy, dz;
+			for (dx = -1; dx <= 1; dx++)
+			{
+				for (dy = -1; dy <= 1; dy++)
+				{
+					for (dz = -1; dz <= 1; dz++)
+					{
+						if (!dx && !dy && !dz)
+						{
+							continue;
+						}
+						ivec3 c = { from.x + dx, from.y + dy, from.z + dz };
+						while (c.x >= 0 && c.x < size.x && c.y >= 0 && c.y < size.y && c.z >= 0 && c.z < size.z)
+						{
+							if (keeper[(c.z * size.y + c.y) * size.x + c.x] >= 0)
+							{
+								blocked++;
+								axesBlocked += (dx != 0) + (dy != 0) + (dz != 0) == 1;
+								break;
+							}
+							c = { c.x + dx, c.y + dy, c.z + dz };
+						}
+					}
+				}
+			}
+			if (axesBlocked == 6 && (blocked == 26 ||
+				(blocked >= thinned && keeper[(from.z * size.y + from.y) * size.x + from.x] != aLeaf)))
+			{
+				mTwigCulled[aLeaf] = 1;
+			}
+		});
+	}
+
+	void Skeleton::layout(const Properties &aProperties, Arena &aArena)
+	{
+		int32 i;
+
+		// Every fork of a level has the same number of ring vertices and faces,
+		// and every leaf a single end vertex, so branch offsets follow from the
+		// level blocks. A branch ring is joined to its parent ring with one face
+		// per segment of either ring, a leaf with one per parent segment. The
+		// root ring takes the first vertices.
+		mLevelSegments = aArena.alloc<int32>(mLevelCount);
+		mLevelVertStride = aArena.alloc<int32>(mLevelCount);
+		mLevelFaceStride = aArena.alloc<int32>(mLevelCount);
+		mLevelVertBase = aArena.alloc<int32>(mLevelCount + 1);
+		mLevelFaceBase = aArena.alloc<int32>(mLevelCount + 1);
+		for (i = 0; i < mLevelCount; i++)
+		{
+			int32 leaf = i == mLevelCount - 1;
+			int32 segments = leaf ? mLevelSegments[i - 1] : aProperties.levelSegments(i);
+			mLevelSegments[i] = segments;
+			mLevelVertStride[i] = leaf ? 1 : forkVertCount(segments);
+			mLevelFaceStride[i] = leaf ? segments : segments + (i > 0 ? mLevelSegments[i - 1] : segments);
+		}
+		mLevelVertBase[0] = mLevelSegments[0];
+		mLevelFaceBase[0] = 0;
+		for (i = 0; i < mLevelCount; i++)
+		{
+			int32 size = mLevelStart[i + 1] - mLevelStart[i];
+			mLevelVertBase[i + 1] = mLevelVertBase[i] + size * mLevelVertStride[i];
+			mLevelFaceBase[i + 1] = mLevelFaceBase[i] + size * mLevelFaceStride[i];
+		}
+	}
+
+	void Skeleton::initLevelTables(const Properties &aProperties, Arena &aArena)
+	{
+		int32 levels = mLevelCount - 2;
+		int32 i;
+
+		// Direction offset of the children of each level
+		mLevelOffset = aArena.alloc<fvec3>(levels + 1);
+		for (i = 0; i <= levels; i++)
+		{
+			int32 aLevel = aProperties.mLevels - i;
+			float growAmount = aLevel * aLevel / (float)(aProperties.mLevels * aProperties.mLevels) * aProperties.mGrowAmount;
+			float dropAmount = i * aProperties.mDropAmount;
+			float sweepAmount = i * aProperties.mSweepAmount;
+			mLevelOffset[i] = { sweepAmount, dropAmount + growAmount, 0 };
+		}
+
+		// random() of every key level * 10 + l1 * 5 + l2 a branch can have. Along
+		// the trunk l1 counts the steps, and past it l1 and l2 count child 0 and
+		// child 1 forks. The argument only depends on the key, so the table
+		// matches calling random() per branch exactly. A 0 argument draws from
+		// the counter instead and is marked with -1.
+		mRandomCount = 0;
+		if (aProperties.mRandomMode == RANDOM_LEGACY)
+		{
+			mRandomCount = levels * 10 + (1 + FMath::Max(aProperties.mTreeSteps, 0) + levels) * 5 + (1 + levels) + 1;
+		}
+		mRandom = aArena.alloc<float>(mRandomCount);
+		for (i = 0; i < mRandomCount; i++)
+		{
+			float fixed = i + (float)aProperties.mSeed;
+			mRandom[i] = fixed ? aProperties.random(fixed, mRseed) : -1;
+		}
+
+		// Child lengths per level and trunk fork, filled in once the trunk is split
+		mOriginCount = levels > 0 ? levelSize(1, levels, aProperties.mTreeSteps) : 0;
+		mChildLength = aArena.alloc<float>(FMath::Max(levels, 0) * mOriginCount + 1);
+	}
+
+	float Skeleton::branchRandom(int32 aBranch, const Properties &aProperties)
+	{
+		int32 level = mLevel[aBranch];
+		if (aProperties.mRandomMode == RANDOM_HASH)
+		{
+			return aProperties.hashRandom(level, aBranch - mLevelStart[level]);
+		}
+
+		int32 key = level * 10 + mL1[aBranch] * 5 + mL2[aBranch];
+		check(key < mRandomCount);
+		float r = mRandom[key];
+		if (r < 0)
+		{
+			r = aProperties.random(0, mRseed);
+		}
+		return r;
+	}
+
+	bool Skeleton::extendsTrunk(int32 aBranch, const Properties &aProperties) const
+	{
+		return aProperties.mLevels - mLevel[aBranch] > 0 && mSteps[aBranch] > 0;
+	}
+
+	void Skeleton::split(int32 aBranch, int32 aChild0, int32 aChild1, const Properties &aProperties)
+	{
+		int32 level = mLevel[aBranch];
+		int32 aSteps = mSteps[aBranch];
+		fvec3 po;
+		if (mParent[aBranch] >= 0)
+		{
+			po = mHead[mParent[aBranch]];
+		}
+		else
+		{
+			po = { 0, 0, 0 };
+		}
+		fvec3 so = mHead[aBranch];
+		fvec3 dir = normalize(sub(so, po));
+
+		fvec3 a = { dir.z, dir.x, dir.y };
+		fvec3 normal = cross(dir, a);
+		fvec3 tangent = cross(dir, normal);
+		float r = branchRandom(aBranch, aProperties);
+
+		fvec3 adj = add(scaleVec(normal, r), scaleVec(tangent, 1 - r));
+		if (r > 0.5) adj = scaleVec(adj, -1);
+
+		float clump = (aProperties.mClumpMax - aProperties.mClumpMin) * r + aProperties.mClumpMin;
+		fvec3 newdir = normalize(add(scaleVec(adj, 1 - clump), scaleVec(dir, clump)));
+
+
+		fvec3 newdir2 = mirrorBranch(newdir, dir, aProperties);
+		if (r > 0.5)
+		{
+			fvec3 tmp = newdir;
+			newdir = newdir2;
+			newdir2 = tmp;
+		}
+
+		if (aSteps > 0)
+		{
+			float angle = aSteps / (float)aProperties.mTreeSteps * 2 * M_PI * aProperties.mTwistRate;
+			a = { FMath::Sin(angle), r, FMath::Cos(angle) };
+			newdir2 = normalize(a);
+		}
+
+		a = mLevelOffset[level];
+		newdir = normalize(add(newdir, a));
+		newdir2 = normalize(add(newdir2, a));
+
+		float length = mLength[aBranch];
+		float childLength;
+		if (level > 0)
+		{
+			int32 origin = (aBranch - mLevelStart[level]) >> (level - 1);
+			childLength = mChildLength[(level - 1) * mOriginCount + origin];
+		}
+		else
+		{
+			childLength = fallLength(length, aProperties);
+		}
+		int32 trunk = extendsTrunk(aBranch, aProperties);
+		int32 child0 = aChild0;
+		int32 child1 = aChild1;
+		mChild0[aBranch] = child0;
+		mChild1[aBranch] = child1;
+
+		mHead[child0] = add(so, scaleVec(newdir, length));
+		mHead[child1] = add(so, scaleVec(newdir2, length));
+		mLength[child0] = childLength;
+		mLength[child1] = childLength;
+		mParent[child0] = aBranch;
+		mParent[child1] = aBranch;
+		mTrunktype[child0] = 0;
+		mTrunktype[child1] = 0;
+		mLevel[child0] = level + 1;
+		mLevel[child1] = level + 1;
+		mSteps[child0] = 0;
+		mSteps[child1] = 0;
+		mL1[child0] = mL1[aBranch] + 1;
+		mL2[child0] = mL2[aBranch];
+		mL1[child1] = mL1[aBranch];
+		mL2[child1] = mL2[aBranch] + 1;
+		mTangent[child0] = { 0, 0, 0 };
+		mTangent[child1] = { 0, 0, 0 };
+
+		if (trunk)
+		{
+			a = {
+				(r - 0.5f) * 2 * aProperties.mTrunkKink,
+				aProperties.mClimbRate,
+				(r - 0.5f) * 2 * aProperties.mTrunkKink
+			};
+			mHead[child0] = add(mHead[aBranch], a);
+			mTrunktype[child0] = 1;
+			mLength[child0] = length * aProperties.mTaperRate;
+			mLevel[child0] = level;
+			mSteps[child0] = aSteps - 1;
+		}
+	}
+
+
+	// Vertex index of entry aIndex of a fork ring, see Tree::createFork for the
+	// layout. Ring 0 goes all around the fork, ring 1 and ring 2 are the loops
+	// the first and the second child grow out of.
+	static FORCEINLINE int32 forkRing(int32 aRing, int32 aBase, int32 aSegments, int32 aIndex)
+	{
+		int32 half = aSegments / 2;
+		if (aRing == 0)
+		{
+			return aBase + aIndex;
+		}
+		if (aRing == 1)
+		{
+			if (aIndex < half) return aBase + half + aIndex;
+			if (aIndex == half) return aBase;
+			return aBase + aSegments - 1 + (aIndex - half);
+		}
+		if (aIndex <= half) return aBase + aIndex;
+		return aBase + aSegments - 1 + (aSegments - aIndex);
+	}
+
+
+	// Writes aCount ring vertices, aCenter + aVec rotated around aAxis and
+	// scaled by aRadius, with one rotation per entry of the aCos/aSin tables.
+	// With aSquashDir set each rotated vector is first stretched along it by
+	// aSquash, as scaleInDirection() does. The SIMD path does the same
+	// operations in the same order as the scalar one, four vertices at a
+	// time, so the two agree exactly unless the compiler fuses multiply-adds
+	// in one of them; then they differ by a few ulp (relative 1e-6).
+	static void ringArc(fvec3 *aOut, fvec3 aCenter, float aRadius, fvec3 aVec, fvec3 aAxis, const fvec3 *aSquashDir, float aSquash, const float *aCos, const float *aSin, int32 aCount)
+	{
+		int32 k = 0;
+#if PROCTREE_SIMD
+		fvec3 b = cross(aAxis, aVec);
+		const VectorRegister one = VectorSetFloat1(1.0f);
+		const VectorRegister axisDot = VectorSetFloat1(dot(aAxis, aVec));
+		const VectorRegister vx = VectorSetFloat1(aVec.x);
+		const VectorRegister vy = VectorSetFloat1(aVec.y);
+		const VectorRegister vz = VectorSetFloat1(aVec.z);
+		const VectorRegister bx = VectorSetFloat1(b.x);
+		const VectorRegister by = VectorSetFloat1(b.y);
+		const VectorRegister bz = VectorSetFloat1(b.z);
+		const VectorRegister ax = VectorSetFloat1(aAxis.x);
+		const VectorRegister ay = VectorSetFloat1(aAxis.y);
+		const VectorRegister az = VectorSetFloat1(aAxis.z);
+		const VectorRegister cx = VectorSetFloat1(aCenter.x);
+		const VectorRegister cy = VectorSetFloat1(aCenter.y);
+		const VectorRegister cz = VectorSetFloat1(aCenter.z);
+		const VectorRegister radius = VectorSetFloat1(aRadius);
+		const VectorRegister squash = VectorSetFloat1(aSquash);
+		const fvec3 squashDir = aSquashDir ? *aSquashDir : fvec3{ 0, 0, 0 };
+		const VectorRegister dx = VectorSetFloat1(squashDir.x);
+		const VectorRegister dy = VectorSetFloat1(squashDir.y);
+		const VectorRegister dz = VectorSetFloat1(squashDir.z);
+
+		// The tables are padded so the last batch can read past the arc, only
+		// the lanes inside it are written
+		for (; k < aCount; k += 4)
+		{
+			// Multiplies and adds are kept apart on purpose, see above
+			VectorRegister c = VectorLoad(aCos + k);
+			VectorRegister s = VectorLoad(aSin + k);
+			VectorRegister t = VectorMultiply(axisDot, VectorSubtract(one, c));
+			VectorRegister x = VectorAdd(VectorAdd(VectorMultiply(vx, c), VectorMultiply(bx, s)), VectorMultiply(ax, t));
+			VectorRegister y = VectorAdd(VectorAdd(VectorMultiply(vy, c), VectorMultiply(by, s)), VectorMultiply(ay, t));
+			VectorRegister z = VectorAdd(VectorAdd(VectorMultiply(vz, c), VectorMultiply(bz, s)), VectorMultiply(az, t));
+			if (aSquashDir)
+			{
+				VectorRegister m = VectorAdd(VectorAdd(VectorMultiply(x, dx), VectorMultiply(y, dy)), VectorMultiply(z, dz));
+				VectorRegister f = VectorSubtract(VectorMultiply(m, squash), m);
+				x = VectorAdd(x, VectorMultiply(dx, f));
+				y = VectorAdd(y, VectorMultiply(dy, f));
+				z = VectorAdd(z, VectorMultiply(dz, f));
+			}
+			x = VectorAdd(cx, VectorMultiply(x, radius));
+			y = VectorAdd(cy, VectorMultiply(y, radius));
+			z = VectorAdd(cz, VectorMultiply(z, radius));
+
+			float lanes[3][4];
+			VectorStore(x, lanes[0]);
+			VectorStore(y, lanes[1]);
+			VectorStore(z, lanes[2]);
+			int32 lanesUsed = FMath::Min(aCount - k, 4);
+			int32 j;
+			for (j = 0; j < lanesUsed; j++)
+			{
+				aOut[k + j] = { lanes[0][j], lanes[1][j], lanes[2][j] };
+			}
+		}
+#endif
+		for (; k < aCount; k++)
+		{
+			fvec3 vec = axisRotate(aVec, aAxis, aCos[k], aSin[k]);
+			if (aSquashDir)
+			{
+				vec = scaleInDirection(vec, *aSquashDir, aSquash);
+			}
+			aOut[k] = add(aCenter, scaleVec(vec, aRadius));
+		}
+	}
+
+
+	// Ring size known at compile time. The component only asks for even sizes
+	// up to 32 (HalfSegments 1..16), and each of those gets its own copy of
+	// the per-branch loops so ring indexing and the wrap-around modulo fold
+	// into constants. Any other size goes through RuntimeSegments.
+	template <int32 N>
+	struct FixedSegments
+	{
+		FORCEINLINE int32 get() const { return N; }
+	};
+
+	struct RuntimeSegments
+	{
+		int32 mValue;
+		FORCEINLINE int32 get() const { return mValue; }
+	};
+
+	template <typename Body>
+	static void dispatchSegments(int32 aSegments, const Body &aBody)
+	{
+		switch (aSegments)
+		{
+		case 2: aBody(FixedSegments<2>()); break;
+		case 4: aBody(FixedSegments<4>()); break;
+		case 6: aBody(FixedSegments<6>()); break;
+		case 8: aBody(FixedSegments<8>()); break;
+		case 10: aBody(FixedSegments<10>()); break;
+		case 12: aBody(FixedSegments<12>()); break;
+		case 14: aBody(FixedSegments<14>()); break;
+		case 16: aBody(FixedSegments<16>()); break;
+		case 18: aBody(FixedSegments<18>()); break;
+		case 20: aBody(FixedSegments<20>()); break;
+		case 22: aBody(FixedSegments<22>()); break;
+		case 24: aBody(FixedSegments<24>()); break;
+		case 26: aBody(FixedSegments<26>()); break;
+		case 28: aBody(FixedSegments<28>()); break;
+		case 30: aBody(FixedSegments<30>()); break;
+		case 32: aBody(FixedSegments<32>()); break;
+		default: aBody(RuntimeSegments{ aSegments }); break;
+		}
+	}
+
+
+	// Sweeps [aStart[level], aEnd[level]) one level at a time, so every branch
+	// runs after its parent is done, and passes aBody the ring size of the
+	// level along with each branch. The trunk chain feeds itself and always
+	// runs in order.
+	template <typename Body>
+	static void forEachLevel(const Skeleton &aSkeleton, const int32 *aStart, const int32 *aEnd, int32 aParallelLevel, const Body &aBody)
+	{
+		int32 level;
+		for (level = 0; level < aSkeleton.mLevelCount; level++)
+		{
+			dispatchSegments(aSkeleton.mLevelSegments[level], [&](auto aSegments)
+			{
+				forRange(aStart[level], aEnd[level], level > 0 && isParallel(aParallelLevel, level), [&](int32 aBranch)
+				{
+					aBody(aBranch, aSegments);
+				});
+			});
+		}
+	}
+
+
+	TopologyCache::TopologyCache()
+	{
+		mLevels = 0;
+		mTreeSteps = 0;
+		mSegments = 0;
+		mSegmentFalloff = 1;
+		mMinSegments = 0;
+		mBranchCount = -1;
+		mFaceCount = 0;
+		mDuplicateCount = 0;
+		mBranchCapacity = 0;
+		mFaceCapacity = 0;
+		mDuplicateCapacity = 0;
+
+		mSegOffset = 0;
+		mFace = 0;
+		mDuplicate = 0;
+	}
+
+	TopologyCache::~TopologyCache()
+	{
+		release();
+	}
+
+	bool TopologyCache::matches(const Properties &aProperties, const int32 *aSegOffset, int32 aBranchCount) const
+	{
+		return
+			mBranchCount == aBranchCount &&
+			mLevels == aProperties.mLevels &&
+			mTreeSteps == aProperties.mTreeSteps &&
+			mSegments == aProperties.mSegments &&
+			mSegmentFalloff == aProperties.mSegmentFalloff &&
+			mMinSegments == aProperties.mMinSegments &&
+			memcmp(mSegOffset, aSegOffset, sizeof(int32) * aBranchCount) == 0;
+	}
+
+	void TopologyCache::reserve(int32 aBranchCount, int32 aFaceCount, int32 aDuplicateCount)
+	{
+		// Whatever was cached is about to be overwritten
+		mBranchCount = -1;
+		if (aBranchCount > mBranchCapacity)
+		{
+			delete[] mSegOffset;
+			mBranchCapacity = aBranchCount;
+			mSegOffset = new int32[mBranchCapacity];
+		}
+		if (aFaceCount > mFaceCapacity)
+		{
+			delete[] mFace;
+			mFaceCapacity = aFaceCount;
+			mFace = new ivec3[mFaceCapacity];
+		}
+		if (aDuplicateCount > mDuplicateCapacity)
+		{
+			delete[] mDuplicate;
+			mDuplicateCapacity = aDuplicateCount;
+			mDuplicate = new int32[mDuplicateCapacity];
+		}
+	}
+
+	void TopologyCache::release()
+	{
+		delete[] mSegOffset;
+		delete[] mFace;
+		delete[] mDuplicate;
+
+		mSegOffset = 0;
+		mFace = 0;
+		mDuplicate = 0;
+
+		mBranchCount = -1;
+		mBranchCapacity = 0;
+		mFaceCapacity = 0;
+		mDuplicateCapacity = 0;
+	}
+
+
+	GeneratorContext::GeneratorContext()
+	{
+		mVertCapacity = 0;
+		mTwigVertCapacity = 0;
+		mFaceCapacity = 0;
+		mTwigFaceCapacity = 0;
+		mBranchCapacity = 0;
+
+		mVert = 0;
+		mNormal = 0;
+		mTangent = 0;
+		mUV = 0;
+		mTwigVert = 0;
+		mTwigNormal = 0;
+		mTwigTangent = 0;
+		mTwigUV = 0;
+		mFace = 0;
+		mTwigFace = 0;
+		mBranch = 0;
+		mLevelFaceEnd = 0;
+		mLevelCapacity = 0;
+		mTwigInstance = 0;
+		mTwigInstanceCapacity = 0;
+	}
+
+	GeneratorContext::~GeneratorContext()
+	{
+		release();
+	}
+
+	void GeneratorContext::reserve(int32 aVertCount, int32 aTwigVertCount, int32 aFaceCount, int32 aTwigFaceCount)
+	{
+		// Nothing is kept across a reallocation, every generate() writes its
+		// buffers from scratch
+		if (aVertCount > mVertCapacity)
+		{
+			delete[] mVert;
+			delete[] mNormal;
+			delete[] mTangent;
+			delete[] mUV;
+			mVertCapacity = aVertCount;
+			mVert = new fvec3[mVertCapacity];
+			mNormal = new fvec3[mVertCapacity];
+			mTangent = new fvec4[mVertCapacity];
+			mUV = new fvec2[mVertCapacity];
+		}
+		if (aTwigVertCount > mTwigVertCapacity)
+		{
+			delete[] mTwigVert;
+			delete[] mTwigNormal;
+			delete[] mTwigTangent;
+			delete[] mTwigUV;
+			mTwigVertCapacity = aTwigVertCount;
+			mTwigVert = new fvec3[mTwigVertCapacity];
+			mTwigNormal = new fvec3[mTwigVertCapacity];
+			mTwigTangent = new fvec4[mTwigVertCapacity];
+			mTwigUV = new fvec2[mTwigVertCapacity];
+		}
+		if (aFaceCount > mFaceCapacity)
+		{
+			delete[] mFace;
+			mFaceCapacity = aFaceCount;
+			mFace = new ivec3[mFaceCapacity];
+		}
+		if (aTwigFaceCount > mTwigFaceCapacity)
+		{
+			delete[] mTwigFace;
+			mTwigFaceCapacity = aTwigFaceCount;
+			mTwigFace = new ivec3[mTwigFaceCapacity];
+		}
+	}
+
+	void GeneratorContext::reserveBranches(int32 aBranchCount)
+	{
+		if (aBranchCount > mBranchCapacity)
+		{
+			delete[] mBranch;
+			mBranchCapacity = aBranchCount;
+			mBranch = new SkeletonBranch[mBranchCapacity];
+		}
+	}
+
+	void GeneratorContext::reserveLevels(int32 aLevelCount)
+	{
+		if (aLevelCount > mLevelCapacity)
+		{
+			delete[] mLevelFaceEnd;
+			mLevelCapacity = aLevelCount;
+			mLevelFaceEnd = new int32[mLevelCapacity];
+		}
+	}
+
+	void GeneratorContext::reserveTwigInstances(int32 aCount)
+	{
+		if (aCount > mTwigInstanceCapacity)
+		{
+			delete[] mTwigInstance;
+			mTwigInstanceCapacity = aCount;
+			mTwigInstance = new TwigInstance[mTwigInstanceCapacity];
+		}
+	}
+
+	void GeneratorContext::release()
+	{
+		delete[] mVert;
+		delete[] mNormal;
+		delete[] mTangent;
+		delete[] mUV;
+		delete[] mTwigVert;
+		delete[] mTwigNormal;
+		delete[] mTwigTangent;
+		delete[] mTwigUV;
+		delete[] mFace;
+		delete[] mTwigFace;
+		delete[] mBranch;
+		delete[] mLevelFaceEnd;
+		delete[] mTwigInstance;
+
+		mVert = 0;
+		mNormal = 0;
+		mTangent = 0;
+		mUV = 0;
+		mTwigVert = 0;
+		mTwigNormal = 0;
+		mTwigTangent = 0;
+		mTwigUV = 0;
+		mFace = 0;
+		mTwigFace = 0;
+		mBranch = 0;
+		mLevelFaceEnd = 0;
+		mTwigInstance = 0;
+
+		mVertCapacity = 0;
+		mTwigVertCapacity = 0;
+		mFaceCapacity = 0;
+		mTwigFaceCapacity = 0;
+		mBranchCapacity = 0;
+		mLevelCapacity = 0;
+		mTwigInstanceCapacity = 0;
+
+		mTopology.release();
+	}
+
+	GeneratorContext &GeneratorContext::get()
+	{
+		static thread_local GeneratorContext context;
+		return context;
+	}
+
+
+	Tree::Tree()
+	{
+		mContext = &mOwnContext;
+		mBuffers = 0;
+		init();
+	}
+
+	Tree::Tree(GeneratorContext &aContext)
+	{
+		mContext = &aContext;
+		mBuffers = 0;
+		init();
+	}
+
+	void Tree::init()
+	{
+		mVertCount = 0;
+		mTwigVertCount = 0;
+		mFaceCount = 0;
+		mTwigFaceCount = 0;
+		mBranchCount = 0;
+		mVertCapacity = 0;
+		mRingCos = 0;
+		mRingSin = 0;
+		mQuarterCos = 0;
+		mQuarterSin = 0;
+		mSegOffset = 0;
+		mSweepStart = 0;
+		mSweepEnd = 0;
+
+		mVert = 0;
+		mNormal = 0;
+		mTangent = 0;
+		mUV = 0;
+		mTwigVert = 0;
+		mTwigNormal = 0;
+		mTwigTangent = 0;
+		mTwigUV = 0;
+		mFace = 0;
+		mTwigFace = 0;
+		mBranch = 0;
+		mLevelFaceEnd = 0;
+		mFaceLevelCount = 0;
+		mTwigInstance = 0;
+		mTwigInstanceCount = 0;
+		mCacheReport = VertexCacheReport();
+
+		mContext->mArena.reset();
+	}
+
+	void Tree::allocBuffers(const TreeSize &aSize)
+	{
+		// Vertex buffers leave room for the seam duplicates so fixUVs never
+		// has to reallocate them
+		mVertCapacity = aSize.mVertCount + aSize.mSeamVertCount;
+		int32 twigVerts = aSize.mTwigInstanceCount > 0 ? 0 : aSize.mTwigVertCount;
+		int32 twigFaces = aSize.mTwigInstanceCount > 0 ? 0 : aSize.mTwigFaceCount;
+		if (mBuffers)
+		{
+			mVert = mBuffers->mVert;
+			mNormal = mBuffers->mNormal;
+			mTangent = mBuffers->mTangent;
+			mUV = mBuffers->mUV;
+			mTwigVert = mBuffers->mTwigVert;
+			mTwigNormal = mBuffers->mTwigNormal;
+			mTwigTangent = mBuffers->mTwigTangent;
+			mTwigUV = mBuffers->mTwigUV;
+			mFace = mBuffers->mFace;
+			mTwigFace = mBuffers->mTwigFace;
+		}
+		else
+		{
+			mContext->reserve(mVertCapacity, twigVerts, aSize.mFaceCount, twigFaces);
+
+			mVert = mContext->mVert;
+			mNormal = mContext->mNormal;
+			mTangent = mContext->mTangent;
+			mUV = mContext->mUV;
+			mTwigVert = mContext->mTwigVert;
+			mTwigNormal = mContext->mTwigNormal;
+			mTwigTangent = mContext->mTwigTangent;
+			mTwigUV = mContext->mTwigUV;
+			mFace = mContext->mFace;
+			mTwigFace = mContext->mTwigFace;
+		}
+
+		mVertCount = aSize.mVertCount;
+		mFaceCount = aSize.mFaceCount;
+		mTwigVertCount = twigVerts;
+		mTwigFaceCount = twigFaces;
+
+		mTwigInstance = 0;
+		mTwigInstanceCount = aSize.mTwigInstanceCount;
+		if (mTwigInstanceCount > 0 && mBuffers)
+		{
+			mTwigInstance = mBuffers->mTwigInstances;
+		}
+		else if (mTwigInstanceCount > 0)
+		{
+			mContext->reserveTwigInstances(mTwigInstanceCount);
+			mTwigInstance = mContext->mTwigInstance;
+		}
+	}
+
+	TreeSize Tree::predictSize(const Properties &aProperties)
+	{
+		int32 levels = FMath::Max(aProperties.mLevels, 0);
+		int32 parentSegments = aProperties.levelSegments(0);
+		int32 i;
+
+		// Same level strides as Skeleton::grow
+		TreeSize size;
+		size.mForkCount = 0;
+		size.mLeafCount = Skeleton::levelSize(levels + 1, levels, aProperties.mTreeSteps);
+		size.mVertCount = parentSegments + size.mLeafCount;
+		size.mFaceCount = 0;
+		for (i = 0; i <= levels; i++)
+		{
+			int32 count = Skeleton::levelSize(i, levels, aProperties.mTreeSteps);
+			int32 segments = aProperties.levelSegments(i);
+			size.mForkCount += count;
+			size.mVertCount += count * forkVertCount(segments);
+			size.mFaceCount += count * (parentSegments + segments);
+			parentSegments = segments;
+		}
+		size.mFaceCount += size.mLeafCount * parentSegments;
+		size.mBranchCount = size.mForkCount + size.mLeafCount;
+
+		size.mTwigVertCount = aProperties.mTwigs ? size.mLeafCount * 8 : 0;
+		size.mTwigFaceCount = aProperties.mTwigs ? size.mLeafCount * 4 : 0;
+		size.mTwigInstanceCount = aProperties.mTwigs && aProperties.mTwigInstances ? size.mLeafCount : 0;
+
+		// fixUVs duplicates a vertex at most once, and never a leaf end since
+		// those never sit at U = 0. The arcs a fork's children share hand the
+		// same U to both of them, so the vertices at U = 0 are not bounded by
+		// anything smaller than this. Real trees duplicate between 0.5% and
+		// 44% of it, a few percent from 12 segments up; callers that keep
+		// their vertex arrays should trim them to the real count.
+		size.mSeamVertCount = size.mVertCount - size.mLeafCount;
+		return size;
+	}
+
+	void Tree::generate()
+	{
+		growSkeleton();
+		meshSkeleton();
+
+		// The skeleton is arena-owned, this releases all of it at once
+		mSkeleton = Skeleton();
+		mContext->mArena.reset();
+	}
+
+	void Tree::growSkeleton()
+	{
+		init();
+		mSkeleton.grow(mProperties, mContext->mArena);
+		mSkeleton.mBarkLevels = FMath::Clamp(mSkeleton.mLevelCount - mProperties.mLevelsDropped, 1, mSkeleton.mLevelCount);
+		if (mProperties.mPruneOverlap > 0)
+		{
+			mSkeleton.prune(mProperties, mContext->mArena);
+		}
+		if (mProperties.mTwigCullOcclusion > 0 && mProperties.mTwigs)
+		{
+			mSkeleton.cullTwigs(mProperties, mContext->mArena);
+		}
+		if (mProperties.mKeepSkeleton)
+		{
+			writeBranches();
+		}
+	}
+
+	void Tree::meshSkeleton()
+	{
+		mSweepStart = 0;
+		sweepLevels(0, mSkeleton.mLevelCount - 1);
+		mSegOffset = mContext->mArena.alloc<int32>(mSkeleton.mCount);
+
+		allocBuffers(predictSize(mProperties));
+		initRingTables();
+		createForks();
+		createTwigs();
+		doFaces();
+		mContext->reserveLevels(mSkeleton.mLevelCount);
+		mLevelFaceEnd = mContext->mLevelFaceEnd;
+		mFaceLevelCount = mSkeleton.mLevelCount;
+		if (mSkeleton.dropsBark())
+		{
+			dropPrunedFaces();
+		}
+		else
+		{
+			memcpy(mLevelFaceEnd, mSkeleton.mLevelFaceBase + 1, sizeof(int32) * mFaceLevelCount);
+		}
+		if (mSkeleton.mPruned || mSkeleton.mTwigCulled)
+		{
+			dropHiddenTwigs();
+		}
+		if (!mProperties.mAnalyticNormals)
+		{
+			calcNormals();
+		}
+		calcTangents();
+		fixUVs();
+		if (mSkeleton.dropsBark())
+		{
+			dropUnusedVerts();
+		}
+		if (mProperties.mProgressiveOrder)
+		{
+			orderTwigsByImportance();
+		}
+		if (mProperties.mOptimizeVertexCache)
+		{
+			optimizeVertexCache();
+		}
+	}
+
+	void Tree::generate(TreeBuffers &aBuffers)
+	{
+		mBuffers = &aBuffers;
+		generate();
+		mBuffers = 0;
+
+		aBuffers.mVertCount = mVertCount;
+		aBuffers.mTwigVertCount = mTwigVertCount;
+		aBuffers.mFaceCount = mFaceCount;
+		aBuffers.mTwigFaceCount = mTwigFaceCount;
+		aBuffers.mBranchCount = mBranchCount;
+		aBuffers.mTwigInstanceCount = mTwigInstanceCount;
+	}
+
+	MeshStreams::MeshStreams()
+	{
+		mPosition = 0;
+		mPositionStride = sizeof(fvec3);
+		mNormal = 0;
+		mNormalStride = sizeof(fvec3);
+		mTangent = 0;
+		mTangentStride = sizeof(fvec3);
+		mTangentFlip = 0;
+		mTangentFlipStride = sizeof(bool);
+		mUV = 0;
+		mUVStride = sizeof(fvec2);
+		mIndex = 0;
+		mPackedNormal = 0;
+		mPackedNormalStride = sizeof(uint32);
+		mPackedTangent = 0;
+		mPackedTangentStride = sizeof(uint32);
+		mHalfUV = 0;
+		mHalfUVStride = sizeof(uint32);
+		mIndex16 = 0;
+		mIndexRanges = 0;
+		mIndexRangeCapacity = 0;
+		mIndexRangeCount = 0;
+		mVertCount = 0;
+		mFaceCount = 0;
+		mBoundsMin = { 0, 0, 0 };
+		mBoundsMax = { 0, 0, 0 };
+	}
+
+	OutputFormat::OutputFormat()
+	{
+		mSwapYZ = false;
+		mScale = 1;
+		mTwigInstances = 0;
+		mTwigInstanceCount = 0;
+	}
+
+	template <typename T>
+	static FORCEINLINE T &streamAt(T *aBase, int32 aStride, int32 aIndex)
+	{
+		return *(T*)((uint8*)aBase + (SIZE_T)aStride * aIndex);
+	}
+
+	static FORCEINLINE fvec3 swizzle(fvec3 a, bool aSwapYZ)
+	{
+		return aSwapYZ ? fvec3{ a.x, a.z, a.y } : a;
+	}
+
+	// Rotation taking the x, y and z axes to the orthonormal aX, aY and aZ
+	static fvec4 basisRotation(fvec3 aX, fvec3 aY, fvec3 aZ)
+	{
+		float trace = aX.x + aY.y + aZ.z;
+		fvec4 q;
+		if (trace > 0)
+		{
+			float s = FMath::Sqrt(trace + 1) * 2;
+			q = { (aY.z - aZ.y) / s, (aZ.x - aX.z) / s, (aX.y - aY.x) / s, s / 4 };
+		}
+		else if (aX.x > aY.y && aX.x > aZ.z)
+		{
+			float s = FMath::Sqrt(1 + aX.x - aY.y - aZ.z) * 2;
+			q = { s / 4, (aY.x + aX.y) / s, (aZ.x + aX.z) / s, (aY.z - aZ.y) / s };
+		}
+		else if (aY.y > aZ.z)
+		{
+			float s = FMath::Sqrt(1 + aY.y - aX.x - aZ.z) * 2;
+			q = { (aY.x + aX.y) / s, s / 4, (aZ.y + aY.z) / s, (aZ.x - aX.z) / s };
+		}
+		else
+		{
+			float s = FMath::Sqrt(1 + aZ.z - aX.x - aY.y) * 2;
+			q = { (aZ.x + aX.z) / s, (aZ.y + aY.z) / s, s / 4, (aX.y - aY.x) / s };
+		}
+		return q;
+	}
+
+	static fvec3 rotateVector(fvec4 aRotation, fvec3 aVector)
+	{
+		fvec3 axis = { aRotation.x, aRotation.y, aRotation.z };
+		fvec3 t = scaleVec(cross(axis, aVector), 2);
+		return add(add(aVector, scaleVec(t, aRotation.w)), cross(axis, t));
+	}
+
+	// Center of the card a twig instance places
+	static FORCEINLINE fvec3 twigCardCenter(const TwigInstance &aInstance)
+	{
+		return add(aInstance.mPosition, rotateVector(aInstance.mRotation, { 0, aInstance.mScale, 0 }));
+	}
+
+	// Bounds of the corners of the cards that aCount twig instances place
+	static void twigInstanceBounds(const TwigInstance *aInstance, int32 aCount, fvec3 &aMin, fvec3 &aMax)
+	{
+		aMin = { FLT_MAX, FLT_MAX, FLT_MAX };
+		aMax = { -FLT_MAX, -FLT_MAX, -FLT_MAX };
+		int32 i, j;
+		for (i = 0; i < aCount; i++)
+		{
+			const TwigInstance &instance = aInstance[i];
+			for (j = 0; j < 4; j++)
+			{
+				fvec3 corner = { j & 1 ? instance.mScale : -instance.mScale, j & 2 ? instance.mScale * 2 : 0, 0 };
+				fvec3 v = add(instance.mPosition, rotateVector(instance.mRotation, corner));
+				aMin = { FMath::Min(aMin.x, v.x), FMath::Min(aMin.y, v.y), FMath::Min(aMin.z, v.z) };
+				aMax = { FMath::Max(aMax.x, v.x), FMath::Max(aMax.y, v.y), FMath::Max(aMax.z, v.z) };
+			}
+		}
+	}
+
+	static FORCEINLINE uint32 packSigned(float a)
+	{
+		return (uint8)(int8)FMath::RoundToInt(FMath::Clamp(a, -1.0f, 1.0f) * 127);
+	}
+
+	static FORCEINLINE uint32 packVector(fvec3 a, int32 aW)
+	{
+		return packSigned(a.x) | packSigned(a.y) << 8 | packSigned(a.z) << 16 | (uint32)(uint8)(int8)aW << 24;
+	}
+
+	// Rounds to the nearest half float, ties to even; out of range values
+	// become infinity and tiny ones denormals or zero
+	static uint32 floatToHalf(float aValue)
+	{
+		uint32 bits;
+		memcpy(&bits, &aValue, sizeof(bits));
+		uint32 sign = (bits >> 16) & 0x8000;
+		uint32 magnitude = bits & 0x7fffffff;
+		if (magnitude >= 0x7f800000)
+		{
+			// infinity stays infinity, NaN stays NaN
+			return sign | 0x7c00 | (magnitude > 0x7f800000 ? 0x200 : 0);
+		}
+		if (magnitude >= 0x477ff000)
+		{
+			return sign | 0x7c00;
+		}
+		if (magnitude < 0x38800000)
+		{
+			// Denormal: shift the mantissa with its implicit bit into place
+			if (magnitude < 0x33000000)
+			{
+				return sign;
+			}
+			uint32 shift = 126 - (magnitude >> 23);
+			uint32 mantissa = (magnitude & 0x7fffff) | 0x800000;
+			uint32 half = mantissa >> shift;
+			uint32 rest = mantissa & ((1u << shift) - 1);
+			uint32 midpoint = 1u << (shift - 1);
+			if (rest > midpoint || (rest == midpoint && (half & 1)))
+			{
+				half++;
+			}
+			return sign | half;
+		}
+		uint32 half = (magnitude - 0x38000000) >> 13;
+		uint32 rest = magnitude & 0x1fff;
+		if (rest > 0x1000 || (rest == 0x1000 && (half & 1)))
+		{
+			half++;
+		}
+		return sign | half;
+	}
+
+	// Splits the faces into 16-bit ranges; false when they do not fit
+	static bool writeIndices16(MeshStreams &aStreams, const ivec3 *aFace, int32 aFaceCount)
+	{
+		int32 ranges = 0;
+		int32 start = 0;
+		int32 lo = 0;
+		int32 hi = 0;
+		int32 i, j;
+		for (i = 0; i <= aFaceCount; i++)
+		{
+			int32 faceLo = 0;
+			int32 faceHi = 0;
+			if (i < aFaceCount)
+			{
+				faceLo = FMath::Min(aFace[i].x, FMath::Min(aFace[i].y, aFace[i].z));
+				faceHi = FMath::Max(aFace[i].x, FMath::Max(aFace[i].y, aFace[i].z));
+				if (faceHi - faceLo > 0xffff)
+				{
+					return false;
+				}
+				if (i == start)
+				{
+					lo = faceLo;
+					hi = faceHi;
+					continue;
+				}
+				if (FMath::Max(hi, faceHi) - FMath::Min(lo, faceLo) <= 0xffff)
+				{
+					lo = FMath::Min(lo, faceLo);
+					hi = FMath::Max(hi, faceHi);
+					continue;
+				}
+			}
+			if (i == start)
+			{
+				break;
+			}
+
+			// Faces start..i-1 make up the next range
+			if (ranges == aStreams.mIndexRangeCapacity)
+			{
+				return false;
+			}
+			aStreams.mIndexRanges[ranges++] = { start * 3, (i - start) * 3, lo, hi - lo + 1 };
+			for (j = start; j < i; j++)
+			{
+				aStreams.mIndex16[j * 3 + 0] = (uint16)(aFace[j].x - lo);
+				aStreams.mIndex16[j * 3 + 1] = (uint16)(aFace[j].y - lo);
+				aStreams.mIndex16[j * 3 + 2] = (uint16)(aFace[j].z - lo);
+			}
+			start = i;
+			lo = faceLo;
+			hi = faceHi;
+		}
+		aStreams.mIndexRangeCount = ranges;
+		return true;
+	}
+
+	// Splits the faces into 16-bit ranges that each get their own block of
+	// the vertices they use, in order of first use; a vertex used by several
+	// ranges is copied into each. Faces keep their order. aSource gets the
+	// vertex each output vertex is copied from and aOutVertCount their count;
+	// false when they run past aVertCapacity or the ranges past their
+	// capacity.
+	static bool splitIndices16(MeshStreams &aStreams, const ivec3 *aFace, int32 aFaceCount, int32 aVertCount, int32 aVertCapacity, Arena &aScratch, int32 *&aSource, int32 &aOutVertCount)
+	{
+		int32 *slot = aScratch.alloc<int32>(aVertCount); // output vertex of a vertex in the range that last used it
+		int32 *lastRange = aScratch.alloc<int32>(aVertCount);
+		int32 *source = aScratch.alloc<int32>(aVertCapacity);
+		int32 ranges = 0;
+		int32 start = 0;
+		int32 base = 0;
+		int32 count = 0;
+		int32 i, k;
+		for (i = 0; i < aVertCount; i++)
+		{
+			lastRange[i] = -1;
+		}
+		i = 0;
+		while (i <= aFaceCount)
+		{
+			if (i < aFaceCount)
+			{
+				int32 v[3] = { aFace[i].x, aFace[i].y, aFace[i].z };
+				int32 added = 0;
+				for (k = 0; k < 3; k++)
+				{
+					added += lastRange[v[k]] != ranges && (k < 1 || v[k] != v[0]) && (k < 2 || v[k] != v[1]);
+				}
+				if (count - base + added <= 0x10000)
+				{
+					if (count + added > aVertCapacity)
+					{
+						return false;
+					}
+					for (k = 0; k < 3; k++)
+					{
+						if (lastRange[v[k]] != ranges)
+						{
+							lastRange[v[k]] = ranges;
+							slot[v[k]] = count;
+							source[count++] = v[k];
+						}
+						aStreams.mIndex16[i * 3 + k] = (uint16)(slot[v[k]] - base);
+					}
+					i++;
+					continue;
+				}
+			}
+			if (i == start)
+			{
+				break;
+			}
+
+			// Faces start..i-1 make up the next range, face i starts another
+			if (ranges == aStreams.mIndexRangeCapacity)
+			{
+				return false;
+			}
+			aStreams.mIndexRanges[ranges++] = { start * 3, (i - start) * 3, base, count - base };
+			start = i;
+			base = count;
+		}
+		aStreams.mIndexRangeCount = ranges;
+		aSource = source;
+		aOutVertCount = count;
+		return true;
+	}
+
+	void Tree::generate(OutputFormat &aFormat)
+	{
+		generate();
+		writeOutput(aFormat);
+	}
+
+	void Tree::generateLods(OutputFormat *aFormats, const LodSettings *aLods, int32 aLodCount)
+	{
+		growSkeleton();
+
+		// Every LOD is meshed from the same branches. The layout and culling
+		// of one LOD live above the marker and are gone before the next.
+		Skeleton &sk = mSkeleton;
+		Arena &arena = mContext->mArena;
+		Properties full = mProperties;
+		uint8 *culled = sk.mTwigCulled;
+		VertexCacheReport report;
+		Arena::Marker marker = arena.mark();
+		int32 i;
+		for (i = 0; i < aLodCount; i++)
+		{
+			const LodSettings &lod = aLods[i];
+			int32 minSegments = FMath::Min(full.mSegments, full.mMinSegments);
+			mProperties.mSegments = FMath::Max(full.mSegments - FMath::Max(lod.mSegmentsCut, 0) / 2 * 2, minSegments);
+			sk.layout(mProperties, arena);
+			sk.mBarkLevels = FMath::Clamp(sk.mLevelCount - full.mLevelsDropped - lod.mLevelsDropped, 1, sk.mLevelCount);
+			sk.mTwigCulled = culled;
+			// A lower share thins more, so a LOD only ever culls more than the tree
+			if (lod.mTwigCullOcclusion > 0 && (full.mTwigCullOcclusion <= 0 || lod.mTwigCullOcclusion < full.mTwigCullOcclusion) && full.mTwigs)
+			{
+				mProperties.mTwigCullOcclusion = lod.mTwigCullOcclusion;
+				sk.mTwigCulled = 0;
+				sk.cullTwigs(mProperties, arena);
+			}
+
+			meshSkeleton();
+			writeOutput(aFormats[i]);
+			if (i == 0)
+			{
+				report = mCacheReport;
+			}
+
+			mProperties = full;
+			arena.rewind(marker);
+		}
+		mCacheReport = report;
+
+		mSkeleton = Skeleton();
+		arena.reset();
+	}
+
+	void Tree::writeOutput(OutputFormat &aFormat)
+	{
+		writeStreams(aFormat.mBranches, aFormat.mSwapYZ, aFormat.mScale, mVert, mNormal, mTangent, mUV, mVertCount, mVertCapacity, mFace, mFaceCount, &mContext->mArena);
+		writeStreams(aFormat.mTwigs, aFormat.mSwapYZ, aFormat.mScale, mTwigVert, mTwigNormal, mTwigTangent, mTwigUV, mTwigVertCount, mTwigVertCount, mTwigFace, mTwigFaceCount, &mContext->mArena);
+
+		aFormat.mTwigInstanceCount = 0;
+		if (!mTwigInstance || !aFormat.mTwigInstances)
+		{
+			return;
+		}
+		int32 i;
+		for (i = 0; i < mTwigInstanceCount; i++)
+		{
+			// The card is mirrored for swapped axes, see writeTwigCard, so
+			// the rotation stays proper
+			const TwigInstance &from = mTwigInstance[i];
+			fvec3 x = swizzle(rotateVector(from.mRotation, { 1, 0, 0 }), aFormat.mSwapYZ);
+			fvec3 y = swizzle(rotateVector(from.mRotation, { 0, 1, 0 }), aFormat.mSwapYZ);
+			TwigInstance &to = aFormat.mTwigInstances[i];
+			to.mPosition = scaleVec(swizzle(from.mPosition, aFormat.mSwapYZ), aFormat.mScale);
+			to.mScale = from.mScale * aFormat.mScale;
+			to.mRotation = aFormat.mSwapYZ ? basisRotation(x, y, cross(x, y)) : from.mRotation;
+		}
+		aFormat.mTwigInstanceCount = mTwigInstanceCount;
+		twigInstanceBounds(aFormat.mTwigInstances, mTwigInstanceCount, aFormat.mTwigs.mBoundsMin, aFormat.mTwigs.mBoundsMax);
+	}
+
+	void Tree::writeStreams(MeshStreams &aStreams, bool aSwapYZ, float aScale, const fvec3 *aVert, const fvec3 *aNormal, const fvec4 *aTangent, const fvec2 *aUV, int32 aVertCount, int32 aVertCapacity, const ivec3 *aFace, int32 aFaceCount, Arena *aScratch)
+	{
+		// Ranges over the vertices as they are come first; ranges with their
+		// own vertex blocks change which vertices are written
+		int32 *source = 0;
+		int32 outVertCount = aVertCount;
+		Arena::Marker marker = aScratch ? aScratch->mark() : Arena::Marker();
+		aStreams.mIndexRangeCount = 0;
+		bool index16 = aStreams.mIndex16 &&
+			(writeIndices16(aStreams, aFace, aFaceCount) ||
+			(aScratch && splitIndices16(aStreams, aFace, aFaceCount, aVertCount, aVertCapacity, *aScratch, source, outVertCount)));
+		if (!index16)
+		{
+			aStreams.mIndexRangeCount = 0;
+		}
+
+		fvec3 lo = { FLT_MAX, FLT_MAX, FLT_MAX };
+		fvec3 hi = { -FLT_MAX, -FLT_MAX, -FLT_MAX };
+		int32 o;
+		for (o = 0; o < outVertCount; o++)
+		{
+			int32 i = source ? source[o] : o;
+			fvec3 pos = scaleVec(swizzle(aVert[i], aSwapYZ), aScale);
+			lo = { FMath::Min(lo.x, pos.x), FMath::Min(lo.y, pos.y), FMath::Min(lo.z, pos.z) };
+			hi = { FMath::Max(hi.x, pos.x), FMath::Max(hi.y, pos.y), FMath::Max(hi.z, pos.z) };
+			if (aStreams.mPosition)
+			{
+				streamAt(aStreams.mPosition, aStreams.mPositionStride, o) = pos;
+			}
+			if (aStreams.mNormal)
+			{
+				streamAt(aStreams.mNormal, aStreams.mNormalStride, o) = swizzle(aNormal[i], aSwapYZ);
+			}
+			if (aStreams.mTangent)
+			{
+				fvec4 t = aTangent[i];
+				streamAt(aStreams.mTangent, aStreams.mTangentStride, o) = swizzle({ t.x, t.y, t.z }, aSwapYZ);
+			}
+			if (aStreams.mTangentFlip)
+			{
+				// Swapping two axes mirrors the basis, which flips the bitangent sign
+				streamAt(aStreams.mTangentFlip, aStreams.mTangentFlipStride, o) = aSwapYZ ? aTangent[i].w > 0 : aTangent[i].w < 0;
+			}
+			if (aStreams.mUV)
+			{
+				streamAt(aStreams.mUV, aStreams.mUVStride, o) = aUV[i];
+			}
+			if (aStreams.mPackedNormal)
+			{
+				bool flip = aSwapYZ ? aTangent[i].w > 0 : aTangent[i].w < 0;
+				streamAt(aStreams.mPackedNormal, aStreams.mPackedNormalStride, o) = packVector(swizzle(aNormal[i], aSwapYZ), flip ? -127 : 127);
+			}
+			if (aStreams.mPackedTangent)
+			{
+				fvec4 t = aTangent[i];
+				streamAt(aStreams.mPackedTangent, aStreams.mPackedTangentStride, o) = packVector(swizzle({ t.x, t.y, t.z }, aSwapYZ), 0);
+			}
+			if (aStreams.mHalfUV)
+			{
+				streamAt(aStreams.mHalfUV, aStreams.mHalfUVStride, o) = floatToHalf(aUV[i].u) | floatToHalf(aUV[i].v) << 16;
+			}
+		}
+		aStreams.mBoundsMin = lo;
+		aStreams.mBoundsMax = hi;
+		aStreams.mVertCount = outVertCount;
+		aStreams.mFaceCount = aFaceCount;
+		if (aScratch)
+		{
+			aScratch->rewind(marker);
+		}
+
+		if (!index16 && aStreams.mIndex)
+		{
+			for (int32 i = 0; i < aFaceCount; i++)
+			{
+				aStreams.mIndex[i * 3 + 0] = aFace[i].x;
+				aStreams.mIndex[i * 3 + 1] = aFace[i].y;
+				aStreams.mIndex[i * 3 + 2] = aFace[i].z;
+			}
+		}
+	}
+
+	void Tree::sweepLevels(int32 aFirst, int32 aLast)
+	{
+		const Skeleton &sk = mSkeleton;
+		if (!mSweepStart)
+		{
+			mSweepStart = mContext->mArena.alloc<int32>(sk.mLevelCount);
+			mSweepEnd = mContext->mArena.alloc<int32>(sk.mLevelCount);
+		}
+		int32 level;
+		for (level = 0; level < sk.mLevelCount; level++)
+		{
+			bool swept = level >= aFirst && level <= aLast;
+			mSweepStart[level] = sk.mLevelStart[level];
+			mSweepEnd[level] = swept ? sk.mLevelStart[level + 1] : sk.mLevelStart[level];
+		}
+	}
+
+	void Tree::generate(TreeSink &aSink, int32 aChunkBranches)
+	{
+		init();
+		Skeleton &sk = mSkeleton;
+		Arena &arena = mContext->mArena;
+		sk.grow(mProperties, arena);
+		if (mProperties.mTwigCullOcclusion > 0 && mProperties.mTwigs)
+		{
+			sk.cullTwigs(mProperties, arena);
+		}
+		if (mProperties.mKeepSkeleton)
+		{
+			writeBranches();
+		}
+		mSegOffset = arena.alloc<int32>(sk.mCount);
+		initRingTables();
+
+		// Chunks are runs of whole subtrees rooted at one level, the highest
+		// one whose subtrees fit the budget. Past the trunk a subtree takes a
+		// contiguous block of every level below its root, and so does a run of
+		// neighbouring subtrees.
+		int32 leafLevel = sk.mLevelCount - 1;
+		int32 rootLevel = 1;
+		while (rootLevel < leafLevel && (2 << (leafLevel - rootLevel)) - 1 > aChunkBranches)
+		{
+			rootLevel++;
+		}
+		int32 rootsPerChunk = FMath::Max(aChunkBranches / ((2 << (leafLevel - rootLevel)) - 1), 1);
+		int32 *levelVertBase = sk.mLevelVertBase;
+		int32 *levelFaceBase = sk.mLevelFaceBase;
+		int32 i;
+
+		// The crown is everything above the chunk roots. The roots' own rings
+		// and faces come along, as those faces still count towards the normals
+		// of the crown's last rings, but they are only handed out with their
+		// chunk.
+		int32 crownVerts = levelVertBase[rootLevel];
+		int32 crownFaces = levelFaceBase[rootLevel];
+		int32 workVerts = levelVertBase[rootLevel + 1];
+		mVertCount = workVerts;
+		mFaceCount = levelFaceBase[rootLevel + 1];
+		mTwigVertCount = 0;
+		mTwigFaceCount = 0;
+		mVertCapacity = workVerts + crownVerts;
+		mVert = arena.alloc<fvec3>(mVertCapacity);
+		mNormal = arena.alloc<fvec3>(mVertCapacity);
+		mTangent = arena.alloc<fvec4>(mVertCapacity);
+		mUV = arena.alloc<fvec2>(mVertCapacity);
+		mFace = arena.alloc<ivec3>(mFaceCount);
+
+		sweepLevels(0, rootLevel);
+		createForks();
+		doFaces();
+		if (!mProperties.mAnalyticNormals)
+		{
+			calcNormals();
+		}
+		sweepLevels(0, rootLevel - 1);
+		calcTangents();
+
+		// The crown's seam duplicates take the place of the root rings
+		mFaceCount = crownFaces;
+		int32 crownDups = findSeams(arena.alloc<int32>(crownVerts));
+		memmove(mVert + crownVerts, mVert + workVerts, sizeof(fvec3) * crownDups);
+		memmove(mNormal + crownVerts, mNormal + workVerts, sizeof(fvec3) * crownDups);
+		memmove(mTangent + crownVerts, mTangent + workVerts, sizeof(fvec4) * crownDups);
+		memmove(mUV + crownVerts, mUV + workVerts, sizeof(fvec2) * crownDups);
+		for (i = 0; i < crownFaces * 3; i++)
+		{
+			int32 &index = (&mFace[0].x)[i];
+			if (index >= workVerts)
+			{
+				index -= workVerts - crownVerts;
+			}
+		}
+
+		TreeChunk chunk;
+		chunk.mVertStart = 0;
+		chunk.mVertCount = crownVerts + crownDups;
+		chunk.mFaceStart = 0;
+		chunk.mFaceCount = crownFaces;
+		chunk.mTwigVertStart = 0;
+		chunk.mTwigVertCount = 0;
+		chunk.mTwigFaceStart = 0;
+		chunk.mTwigFaceCount = 0;
+		chunk.mVert = mVert;
+		chunk.mNormal = mNormal;
+		chunk.mTangent = mTangent;
+		chunk.mUV = mUV;
+		chunk.mFace = mFace;
+		chunk.mTwigVert = 0;
+		chunk.mTwigNormal = 0;
+		chunk.mTwigTangent = 0;
+		chunk.mTwigUV = 0;
+		chunk.mTwigFace = 0;
+		aSink.consume(chunk);
+
+		const fvec3 *crownVert = mVert;
+		const fvec3 *crownNormal = mNormal;
+		const fvec4 *crownTangent = mTangent;
+		const fvec2 *crownUV = mUV;
+
+		// A chunk works on its own copy of the parent rings of its roots,
+		// followed by its levels in order. Pointing the level tables at that
+		// layout leaves the per-branch stages unchanged.
+		int32 parentLevel = rootLevel - 1;
+		TreeSize size;
+		size.mVertCount = rootsPerChunk * sk.mLevelVertStride[parentLevel];
+		size.mFaceCount = 0;
+		int32 twigVerts = mProperties.mTwigs ? 8 : 0;
+		int32 twigFaces = mProperties.mTwigs ? 4 : 0;
+		size.mTwigVertCount = (rootsPerChunk << (leafLevel - rootLevel)) * twigVerts;
+		size.mTwigFaceCount = (rootsPerChunk << (leafLevel - rootLevel)) * twigFaces;
+		size.mTwigInstanceCount = 0;
+		for (i = rootLevel; i <= leafLevel; i++)
+		{
+			int32 count = rootsPerChunk << (i - rootLevel);
+			size.mVertCount += count * sk.mLevelVertStride[i];
+			size.mFaceCount += count * sk.mLevelFaceStride[i];
+		}
+		size.mSeamVertCount = size.mVertCount;
+		allocBuffers(size);
+
+		int32 *chunkVertBase = arena.alloc<int32>(sk.mLevelCount + 1);
+		int32 *chunkFaceBase = arena.alloc<int32>(sk.mLevelCount + 1);
+		int32 *dupSource = arena.alloc<int32>(size.mSeamVertCount);
+		sk.mLevelVertBase = chunkVertBase;
+		sk.mLevelFaceBase = chunkFaceBase;
+
+		chunk.mVertStart = crownVerts + crownDups;
+		chunk.mFaceStart = crownFaces;
+		Arena::Marker scratch = arena.mark();
+		int32 first;
+		for (first = sk.mLevelStart[rootLevel]; first < sk.mLevelStart[rootLevel + 1]; first += rootsPerChunk)
+		{
+			int32 last = FMath::Min(first + rootsPerChunk, sk.mLevelStart[rootLevel + 1]);
+			int32 parent = sk.mParent[first];
+			int32 parentVerts = (sk.mParent[last - 1] + 1 - parent) * sk.mLevelVertStride[parentLevel];
+			int32 parentBase = levelVertBase[parentLevel] + (parent - sk.mLevelStart[parentLevel]) * sk.mLevelVertStride[parentLevel];
+
+			sweepLevels(rootLevel, leafLevel);
+			chunkVertBase[parentLevel] = -(parent - sk.mLevelStart[parentLevel]) * sk.mLevelVertStride[parentLevel];
+			int32 vert = parentVerts;
+			int32 face = 0;
+			int32 start = first;
+			int32 end = last;
+			int32 level;
+			for (level = rootLevel; level <= leafLevel; level++)
+			{
+				int32 offset = start - sk.mLevelStart[level];
+				int32 vertCount = sk.mLevelVertStride[level];
+				int32 faceCount = sk.mLevelFaceStride[level];
+				mSweepStart[level] = start;
+				mSweepEnd[level] = end;
+				chunkVertBase[level] = vert - offset * vertCount;
+				chunkFaceBase[level] = face - offset * faceCount;
+				vert += (end - start) * vertCount;
+				face += (end - start) * faceCount;
+				if (level < leafLevel)
+				{
+					start = sk.mLevelStart[level + 1] + offset * 2;
+					end = sk.mLevelStart[level + 1] + (end - sk.mLevelStart[level]) * 2;
+				}
+			}
+			sk.mTwigOrigin = start;
+			mVertCount = vert;
+			mFaceCount = face;
+			mTwigVertCount = (end - start) * twigVerts;
+			mTwigFaceCount = (end - start) * twigFaces;
+
+			memcpy(mVert, crownVert + parentBase, sizeof(fvec3) * parentVerts);
+			memcpy(mNormal, crownNormal + parentBase, sizeof(fvec3) * parentVerts);
+			memcpy(mTangent, crownTangent + parentBase, sizeof(fvec4) * parentVerts);
+			memcpy(mUV, crownUV + parentBase, sizeof(fvec2) * parentVerts);
+
+			createForks();
+			createTwigs();
+			if (sk.mTwigCulled)
+			{
+				dropHiddenTwigs();
+			}
+			doFaces();
+			if (!mProperties.mAnalyticNormals)
+			{
+				// The parent rings only saw part of their faces here, the crown
+				// has their real normals
+				calcNormals();
+				memcpy(mNormal, crownNormal + parentBase, sizeof(fvec3) * parentVerts);
+			}
+			calcTangents();
+			mVertCount += findSeams(dupSource);
+
+			// Renumber into the streamed order: the parent rings are crown
+			// vertices, everything else follows the previous chunks
+			for (i = 0; i < mFaceCount * 3; i++)
+			{
+				int32 &index = (&mFace[0].x)[i];
+				index = index < parentVerts ? parentBase + index : chunk.mVertStart + index - parentVerts;
+			}
+			for (i = 0; i < mTwigFaceCount * 3; i++)
+			{
+				(&mTwigFace[0].x)[i] += chunk.mTwigVertStart;
+			}
+
+			chunk.mVertCount = mVertCount - parentVerts;
+			chunk.mFaceCount = mFaceCount;
+			chunk.mTwigVertCount = mTwigVertCount;
+			chunk.mTwigFaceCount = mTwigFaceCount;
+			chunk.mVert = mVert + parentVerts;
+			chunk.mNormal = mNormal + parentVerts;
+			chunk.mTangent = mTangent + parentVerts;
+			chunk.mUV = mUV + parentVerts;
+			chunk.mFace = mFace;
+			chunk.mTwigVert = mTwigVert;
+			chunk.mTwigNormal = mTwigNormal;
+			chunk.mTwigTangent = mTwigTangent;
+			chunk.mTwigUV = mTwigUV;
+			chunk.mTwigFace = mTwigFace;
+			aSink.consume(chunk);
+
+			chunk.mVertStart += chunk.mVertCount;
+			chunk.mFaceStart += chunk.mFaceCount;
+			chunk.mTwigVertStart += chunk.mTwigVertCount;
+			chunk.mTwigFaceStart += chunk.mTwigFaceCount;
+			arena.rewind(scratch);
+		}
+
+		// Nothing of the tree is kept, the chunks were its only output
+		mVertCount = 0;
+		mFaceCount = 0;
+		mTwigVertCount = 0;
+		mTwigFaceCount = 0;
+		mSkeleton = Skeleton();
+		arena.reset();
+	}
+
+	void Tree::generateSkeleton()
+	{
+		init();
+		mSkeleton.grow(mProperties, mContext->mArena);
+		if (mProperties.mPruneOverlap > 0)
+		{
+			mSkeleton.prune(mProperties, mContext->mArena);
+		}
+		writeBranches();
+
+		mSkeleton = Skeleton();
+		mContext->mArena.reset();
+	}
+
+	void Tree::writeBranches()
+	{
+		const Skeleton &sk = mSkeleton;
+		if (mBuffers)
+		{
+			mBranch = mBuffers->mBranch;
+		}
+		else
+		{
+			mContext->reserveBranches(sk.mCount);
+			mBranch = mContext->mBranch;
+		}
+		mBranchCount = sk.mCount;
+
+		int32 i;
+		for (i = 0; i < sk.mCount; i++)
+		{
+			SkeletonBranch &branch = mBranch[i];
+			int32 parent = sk.mParent[i];
+			branch.mHead = sk.mHead[i];
+			branch.mParentHead = parent >= 0 ? sk.mHead[parent] : fvec3{ 0, 0, 0 };
+			branch.mRadius = FMath::Min(sk.mRadius[i], sk.mLength[i]);
+			branch.mParent = parent;
+			branch.mLevel = sk.mLevel[i];
+			branch.mTrunk = sk.mTrunktype[i] != 0;
+			branch.mLeaf = sk.mChild0[i] < 0;
+			branch.mPruned = sk.pruned(i);
+		}
+	}
+
+	void generateBatch(const Properties *aProperties, TreeBuffers *aBuffers, int32 aCount)
+	{
+		// Order the trees by their predicted amount of work, largest first
+		TArray<int64> cost;
+		TArray<int32> order;
+		cost.SetNumUninitialized(aCount);
+		order.SetNumUninitialized(aCount);
+		int32 i;
+		for (i = 0; i < aCount; i++)
+		{
+			TreeSize size = Tree::predictSize(aProperties[i]);
+			cost[i] = (int64)size.mVertCount + size.mFaceCount + size.mTwigVertCount;
+			order[i] = i;
+		}
+		order.Sort([&cost](int32 a, int32 b)
+		{
+			return cost[a] > cost[b];
+		});
+
+		ParallelFor(aCount, [&](int32 aIndex)
+		{
+			int32 index = order[aIndex];
+			Tree tree(GeneratorContext::get());
+			tree.mProperties = aProperties[index];
+			tree.mProperties.mParallelLevel = -1;
+			tree.generate(aBuffers[index]);
+		});
+	}
+
+	static bool withinBudget(int64 aTriangles, int64 aVertices, int32 aMaxTriangles, int32 aMaxVertices)
+	{
+		return
+			(aMaxTriangles <= 0 || aTriangles <= aMaxTriangles) &&
+			(aMaxVertices <= 0 || aVertices <= aMaxVertices);
+	}
+
+	BudgetCuts fitBudget(Properties &aProperties, int32 aMaxTriangles, int32 aMaxVertices)
+	{
+		Tree tree(GeneratorContext::get());
+		tree.mProperties = aProperties;
+		BudgetCuts cuts = tree.fitBudget(aMaxTriangles, aMaxVertices);
+		aProperties = tree.mProperties;
+		return cuts;
+	}
+
+	BudgetCuts Tree::fitBudget(int32 aMaxTriangles, int32 aMaxVertices)
+	{
+		BudgetCuts cuts = { 0, 0, false, true };
+
+		// predictSize bounds every count from above, a tree it fits needs no
+		// trial meshes
+		TreeSize bound = predictSize(mProperties);
+		if (withinBudget((int64)bound.mFaceCount + bound.mTwigFaceCount, (int64)bound.mVertCount + bound.mSeamVertCount + bound.mTwigVertCount, aMaxTriangles, aMaxVertices))
+		{
+			return cuts;
+		}
+
+		// Every trial meshes the same branches the way a LOD of
+		// generateLods() does and only keeps the counts
+		Properties full = mProperties;
+		mProperties.mKeepSkeleton = false;
+		growSkeleton();
+		Skeleton &sk = mSkeleton;
+		Arena &arena = mContext->mArena;
+		mProperties.mOptimizeVertexCache = false;
+		mProperties.mProgressiveOrder = false;
+		mProperties.mTwigInstances = false;
+		Arena::Marker marker = arena.mark();
+		auto fits = [&](int32 aSegments, int32 aBarkLevels, bool aTwigs)
+		{
+			mProperties.mSegments = aSegments;
+			mProperties.mTwigs = aTwigs;
+			sk.layout(mProperties, arena);
+			sk.mBarkLevels = aBarkLevels;
+			meshSkeleton();
+			arena.rewind(marker);
+			return withinBudget((int64)mFaceCount + mTwigFaceCount, (int64)mVertCount + mTwigVertCount, aMaxTriangles, aMaxVertices);
+		};
+
+		// Twigs are the outer loop and segments the inner one, so the first
+		// cut that fits keeps the most of what is cut last. Seam duplicates
+		// make the vertex count jump around as segments go, so every step is
+		// tried.
+		int32 minSegments = FMath::Min(full.mSegments, full.mMinSegments);
+		int32 fewestSegments = full.mSegments - (full.mSegments - minSegments) / 2 * 2;
+		int32 fullBarkLevels = sk.mBarkLevels;
+		int32 segments = fewestSegments;
+		int32 barkLevels = 1;
+		bool twigs = false;
+		cuts.mFits = false;
+		int32 twigPass;
+		for (twigPass = full.mTwigs ? 1 : 0; twigPass >= 0 && !cuts.mFits; twigPass--)
+		{
+			int32 levels;
+			for (levels = fullBarkLevels; levels >= 1 && !cuts.mFits; levels--)
+			{
+				int32 trial;
+				for (trial = full.mSegments; trial >= fewestSegments && !cuts.mFits; trial -= 2)
+				{
+					if (fits(trial, levels, twigPass != 0))
+					{
+						segments = trial;
+						barkLevels = levels;
+						twigs = twigPass != 0;
+						cuts.mFits = true;
+					}
+				}
+			}
+		}
+
+		// Without a fit the smallest tree is as close as it gets
+		cuts.mSegments = full.mSegments - segments;
+		cuts.mLevels = fullBarkLevels - barkLevels;
+		cuts.mTwigs = full.mTwigs && !twigs;
+		mProperties = full;
+		mProperties.mSegments = segments;
+		mProperties.mLevelsDropped = sk.mLevelCount - barkLevels;
+		mProperties.mTwigs = twigs;
+
+		mSkeleton = Skeleton();
+		arena.reset();
+		return cuts;
+	}
+
+	// An edge has wrapped around the texture when its U coordinates are more
+	// than half apart and one of its ends sits at U = 0; that end is the wrong
+	// one. Returns it, or -1 if the edge is fine.
+	static FORCEINLINE int32 seamVert(const fvec2 *aUV, int32 a, int32 b)
+	{
+		if ((FMath::Abs(aUV[a].u - aUV[b].u) > 0.5f) && (aUV[a].u == 0 || aUV[b].u == 0))
+		{
+			return aUV[b].u == 0 ? b : a;
+		}
+		return -1;
+	}
+
+	// Points a face corner at the duplicate of its seam vertex
+	static FORCEINLINE void fixSeamEdge(const fvec2 *aUV, const int32 *aDuplicate, int32 aVertCount, int32 &a, int32 &b)
+	{
+		int32 bad = seamVert(aUV, a, b);
+		if (bad < 0)
+		{
+			return;
+		}
+		// Corners that only become seam edges once an earlier corner of the
+		// face was fixed were never tagged; they have always been pointed at
+		// the first duplicate.
+		int32 dup = aVertCount + FMath::Max(aDuplicate[bad], 0);
+		if (bad == b)
+		{
+			b = dup;
+		}
+		else
+		{
+			a = dup;
+		}
+	}
+
+	void Tree::fixUVs()
+	{
+		// Pruning changes the faces but not the ring joins, so pruned trees
+		// stay out of the cache
+		if (mSkeleton.dropsBark())
+		{
+			mVertCount += findSeams(mContext->mArena.alloc<int32>(mVertCapacity - mVertCount));
+			return;
+		}
+
+		// Seams only depend on U coordinates, and those follow from the ring
+		// layout alone, so a cached topology with the same ring joins already
+		// has them worked out
+		TopologyCache &cache = mContext->mTopology;
+		if (cache.matches(mProperties, mSegOffset, mSkeleton.mCount))
+		{
+			copySeamVerts(cache.mDuplicate, cache.mDuplicateCount);
+			memcpy(mFace, cache.mFace, sizeof(ivec3) * mFaceCount);
+		}
+		else
+		{
+			cache.reserve(mSkeleton.mCount, mFaceCount, mVertCapacity - mVertCount);
+			int32 badverts = findSeams(cache.mDuplicate);
+
+			// keep the result for the next tree with the same ring joins
+			memcpy(cache.mSegOffset, mSegOffset, sizeof(int32) * mSkeleton.mCount);
+			memcpy(cache.mFace, mFace, sizeof(ivec3) * mFaceCount);
+			cache.mLevels = mProperties.mLevels;
+			cache.mTreeSteps = mProperties.mTreeSteps;
+			cache.mSegments = mProperties.mSegments;
+			cache.mSegmentFalloff = mProperties.mSegmentFalloff;
+			cache.mMinSegments = mProperties.mMinSegments;
+			cache.mFaceCount = mFaceCount;
+			cache.mDuplicateCount = badverts;
+			cache.mBranchCount = mSkeleton.mCount;
+		}
+
+		// the duplicates go right after the existing verts, allocBuffers
+		// reserved room for them
+		mVertCount += cache.mDuplicateCount;
+	}
+
+	// Duplicates the vertices the UV seams run through and points the faces
+	// across a seam at them. aSource receives the vertex each duplicate
+	// copies; returns how many there are.
+	int32 Tree::findSeams(int32 *aSource)
+	{
+		int32 *badverttable = aSource;
+		int32 *duplicate = mContext->mArena.alloc<int32>(mVertCount);
+		int32 i;
+		int32 badverts = 0;
+
+		for (i = 0; i < mVertCount; i++)
+		{
+			duplicate[i] = -1;
+		}
+
+		// step 1: find bad verts, in face order so the duplicates keep their order
+		// - If edge's U coordinate delta is over 0.5, texture has wrapped around. 
+		// - The vertex that has zero U is the wrong one
+		// - duplicate[] makes sure a bad vertex is only tagged once.
+		// The edges are checked in parallel, the tagging itself stays in order.
+
+		bool parallel = mProperties.mParallelLevel >= 0;
+		ivec3 *seam = mContext->mArena.alloc<ivec3>(mFaceCount);
+		forRange(0, mFaceCount, parallel, [&](int32 aFace)
+		{
+			const ivec3 &f = mFace[aFace];
+			seam[aFace] = {
+				seamVert(mUV, f.x, f.y), // x/y edges (vertex 0 and 1)
+				seamVert(mUV, f.x, f.z), // x/z edges (vertex 0 and 2)
+				seamVert(mUV, f.y, f.z)  // y/z edges (vertex 1 and 2)
+			};
+		});
+
+		for (i = 0; i < mFaceCount; i++)
+		{
+			int32 bad[3] = { seam[i].x, seam[i].y, seam[i].z };
+			int32 j;
+			for (j = 0; j < 3; j++)
+			{
+				if (bad[j] >= 0 && duplicate[bad[j]] < 0)
+				{
+					duplicate[bad[j]] = badverts;
+					badverttable[badverts++] = bad[j];
+				}
+			}
+		}
+
+		check(mVertCount + badverts <= mVertCapacity);
+
+		// step 2: populate duplicate verts - otherwise identical except for U=1 instead of 0
+
+		copySeamVerts(badverttable, badverts);
+
+		// step 3: fix faces, each corner sees the fixes of the previous ones
+		
+		forRange(0, mFaceCount, parallel, [&](int32 aFace)
+		{
+			ivec3 &f = mFace[aFace];
+			fixSeamEdge(mUV, duplicate, mVertCount, f.x, f.y);
+			fixSeamEdge(mUV, duplicate, mVertCount, f.x, f.z);
+			fixSeamEdge(mUV, duplicate, mVertCount, f.y, f.z);
+		});
+
+		return badverts;
+	}
+
+	void Tree::copySeamVerts(const int32 *aSource, int32 aCount)
+	{
+		forRange(0, aCount, mProperties.mParallelLevel >= 0, [&](int32 aDuplicate)
+		{
+			int32 src = aSource[aDuplicate];
+			int32 dst = mVertCount + aDuplicate;
+			mVert[dst] = mVert[src];
+			mNormal[dst] = mNormal[src];
+			mTangent[dst] = mTangent[src];
+			mUV[dst] = mUV[src];
+			mUV[dst].u = 1.0f;
+		});
+	}
+
+	void Tree::calcNormals()
+	{
+		bool parallel = mProperties.mParallelLevel >= 0;
+		fvec3 *faceNormal = mContext->mArena.alloc<fvec3>(mFaceCount);
+		int32 *normalCount = mContext->mArena.alloc<int32>(mVertCount);
+		memset(normalCount, 0, sizeof(int32) * mVertCount);
+		memset(mNormal, 0, sizeof(fvec3) * mVertCount);
+
+		forRange(0, mFaceCount, parallel, [&](int32 aFace)
+		{
+			const ivec3 &f = mFace[aFace];
+			faceNormal[aFace] = normalize(cross(sub(mVert[f.y], mVert[f.z]), sub(mVert[f.y], mVert[f.x])));
+		});
+
+		// Summed in face order, the same way as on a single thread
+		int32 i;
+		for (i = 0; i < (int)mFaceCount; i++)
+		{
+			normalCount[mFace[i].x]++;
 			normalCount[mFace[i].y]++;
 			normalCount[mFace[i].z]++;
 
-			fvec3 norm = normalize(cross(sub(mVert[mFace[i].y], mVert[mFace[i].z]), sub(mVert[mFace[i].y], mVert[mFace[i].x])));
+			fvec3 norm = faceNormal[i];
+
+			mNormal[mFace[i].x].x += norm.x;
+			mNormal[mFace[i].x].y += norm.y;
+			mNormal[mFace[i].x].z += norm.z;
+			mNormal[mFace[i].y].x += norm.x;
+			mNormal[mFace[i].y].y += norm.y;
+			mNormal[mFace[i].y].z += norm.z;
+			mNormal[mFace[i].z].x += norm.x;
+			mNormal[mFace[i].z].y += norm.y;
+			mNormal[mFace[i].z].z += norm.z;
+		}
+
+		forRange(0, mVertCount, parallel, [&](int32 aVert)
+		{
+			float d = 1.0f / normalCount[aVert];
+			mNormal[aVert].x *= d;
+			mNormal[aVert].y *= d;
+			mNormal[aVert].z *= d;
+		});
+	}
+
+	void Tree::doFaces()
+	{
+		// A branch takes its U coordinates from the ring of its parent
+		forEachLevel(mSkeleton, mSweepStart, mSweepEnd, mProperties.mParallelLevel, [&](int32 aBranch, auto aSegments)
+		{
+			doBranchFaces(aBranch, aSegments);
+		});
+	}
+
+	template <typename Segments>
+	void Tree::doBranchFaces(int32 aBranch, Segments aSegments)
+	{
+		Skeleton &sk = mSkeleton;
+		const int32 segments = aSegments.get();
+		int32 face = sk.faceBase(aBranch);
+		int32 base = sk.vertBase(aBranch);
+		int32 parent = sk.mParent[aBranch];
+		int32 i;
+
+		if (sk.barkDropped(aBranch))
+		{
+			capPrunedBranch(aBranch);
+			return;
+		}
+
+		if (parent < 0)
+		{
+			fvec3 head = sk.mHead[aBranch];
+			fvec3 tangent = normalize(cross(sub(sk.mHead[sk.mChild0[aBranch]], head), sub(sk.mHead[sk.mChild1[aBranch]], head)));
+			fvec3 normal = normalize(head);
+			fvec3 left = { -1, 0, 0 };
+			float angle = FMath::Acos(dot(tangent, left));
+			if (dot(cross(left, tangent), normal) > 0)
+			{
+				angle = 2 * M_PI - angle;
+			}
+			int32 segOffset = (int)floor(0.5f + (angle / M_PI / 2 * segments));
+			mSegOffset[aBranch] = segOffset;
+			for (i = 0; i < segments; i++)
+			{
+				// The root ring occupies the first vertices
+				int32 v1 = forkRing(0, base, segments, i);
+				int32 v2 = (i + segOffset + 1) % segments;
+				int32 v3 = (i + segOffset) % segments;
+				int32 v4 = forkRing(0, base, segments, (i + 1) % segments);
+
+				ivec3 a;
+				a = { v1, v4, v3 };
+				mFace[face++] = (a);
+				a = { v4, v2, v3 };
+				mFace[face++] = (a);
+
+				mUV[(i + segOffset) % segments] = { i / (float)segments, 0 };
+
+				float len = length(sub(mVert[v1], mVert[v3])) * mProperties.mVMultiplier;
+				mUV[v1] = { i / (float)segments, len };
+				mUV[forkRing(2, base, segments, i)] = { i / (float)segments, len };
+			}
+			return;
+		}
+
+		// Child 0 grows out of ring 1 of its parent, child 1 out of ring 2
+		int32 side = sk.mChild1[parent] == aBranch;
+		int32 ring = 1 + side;
+		int32 parentBase = sk.vertBase(parent);
+		int32 parentSegments = sk.mLevelSegments[sk.mLevel[parent]];
+
+		if (sk.mChild0[aBranch] >= 0)
+		{
+			int32 segOffset = -1;
+			float match = 0;
+
+			fvec3 v = normalize(sub(mVert[forkRing(ring, parentBase, parentSegments, 0)], sk.mHead[parent]));
+			v = scaleInDirection(v, normalize(sub(sk.mHead[aBranch], sk.mHead[parent])), 0);
+
+			for (i = 0; i < segments; i++)
+			{
+				fvec3 d = normalize(sub(mVert[forkRing(0, base, segments, i)], sk.mHead[aBranch]));
+				float l = dot(d, v);
+				if (segOffset == -1 || l > match)
+				{
+					// The child 1 match used to be kept in an int32; keep truncating
+					// it so the seams of existing trees stay where they were.
+					match = side ? (float)(int32)l : l;
+					segOffset = segments - i;
+				}
+			}
+
+			mSegOffset[aBranch] = segOffset;
+			if (parentSegments != segments)
+			{
+				stitchRings(aBranch, segOffset, segments);
+				return;
+			}
+
+			float UVScale = mProperties.mMaxRadius / sk.mRadius[parent];
+
+			for (i = 0; i < segments; i++)
+			{
+				int32 v1 = forkRing(0, base, segments, i);
+				int32 v2 = forkRing(ring, parentBase, segments, (i + segOffset + 1) % segments);
+				int32 v3 = forkRing(ring, parentBase, segments, (i + segOffset) % segments);
+				int32 v4 = forkRing(0, base, segments, (i + 1) % segments);
+				ivec3 a;
+				if (!side)
+				{
+					a = { v1, v4, v3 };
+					mFace[face++] = (a);
+					a = { v4, v2, v3 };
+					mFace[face++] = (a);
+				}
+				else
+				{
+					a = { v1, v2, v3 };
+					mFace[face++] = (a);
+					a = { v1, v4, v2 };
+					mFace[face++] = (a);
+				}
+
+				float len = length(sub(mVert[v1], mVert[v3])) * UVScale;
+				fvec2 uv = mUV[forkRing(ring, parentBase, segments, (i + segOffset - 1) % segments)];
+
+				mUV[v1] = { uv.u, uv.v + len * mProperties.mVMultiplier };
+				mUV[forkRing(2, base, segments, i)] = { uv.u, uv.v + len * mProperties.mVMultiplier };
+			}
+		}
+		else
+		{
+			mSegOffset[aBranch] = 0;
+			for (i = 0; i < segments; i++)
+			{
+				ivec3 a = {
+					base,
+					forkRing(ring, parentBase, segments, (i + 1) % segments),
+					forkRing(ring, parentBase, segments, i)
+				};
+				mFace[face++] = (a);
+			}
+
+			i = segments - 1;
+			float len = length(sub(mVert[base], mVert[forkRing(ring, parentBase, segments, i)]));
+			mUV[base] = { i / (float)segments - (side ? 0 : 1), len * mProperties.mVMultiplier };
+		}
+	}
+
+	void Tree::stitchRings(int32 aBranch, int32 aSegOffset, int32 aSegments)
+	{
+		// Joins a branch ring to a parent ring with more segments. Child vertex
+		// i lines up with step (i + aSegOffset) of aSegments around the loop,
+		// parent entry j with step j of parentSegments. Both rings are walked
+		// together, always advancing the one whose next vertex comes first, so
+		// every step adds one face. Ties go the way the equal-ring faces of
+		// doBranchFaces split their quads.
+		Skeleton &sk = mSkeleton;
+		int32 parent = sk.mParent[aBranch];
+		int32 parentSegments = sk.mLevelSegments[sk.mLevel[parent]];
+		int32 side = sk.mChild1[parent] == aBranch;
+		int32 ring = 1 + side;
+		int32 face = sk.faceBase(aBranch);
+		int32 base = sk.vertBase(aBranch);
+		int32 parentBase = sk.vertBase(parent);
+		int32 i;
+
+		int32 a = aSegOffset % aSegments;
+		int32 b = a * parentSegments / aSegments;
+		int32 aEnd = a + aSegments;
+		int32 bEnd = b + parentSegments;
+		while (a < aEnd || b < bEnd)
+		{
+			int32 v1 = forkRing(0, base, aSegments, (a - aSegOffset + aSegments) % aSegments);
+			int32 v3 = forkRing(ring, parentBase, parentSegments, b % parentSegments);
+			int32 childNext = (a + 1) * parentSegments;
+			int32 parentNext = (b + 1) * aSegments;
+			ivec3 f;
+			if (b == bEnd || (a < aEnd && (childNext < parentNext || (!side && childNext == parentNext))))
+			{
+				f = { v1, forkRing(0, base, aSegments, (a + 1 - aSegOffset + aSegments) % aSegments), v3 };
+				a++;
+			}
+			else
+			{
+				f = { v1, forkRing(ring, parentBase, parentSegments, (b + 1) % parentSegments), v3 };
+				b++;
+			}
+			mFace[face++] = f;
+		}
+
+		// fixUVs only cuts seams at U = 0, so the child ring reads its U from
+		// the parent entries counted from the one at U = 0, if there is one.
+		// Like the equal rings, each child vertex reads one entry back from
+		// the one it lines up with.
+		int32 zero = 0;
+		for (i = 0; i < parentSegments; i++)
+		{
+			if (mUV[forkRing(ring, parentBase, parentSegments, i)].u == 0)
+			{
+				zero = i;
+				break;
+			}
+		}
+		int32 zeroStep = ((zero + 1) * aSegments + parentSegments / 2) / parentSegments;
+		float UVScale = mProperties.mMaxRadius / sk.mRadius[parent];
+
+		for (i = 0; i < aSegments; i++)
+		{
+			int32 step = (i + aSegOffset) % aSegments;
+			int32 fromZero = (step - zeroStep % aSegments + aSegments) % aSegments;
+			int32 v1 = forkRing(0, base, aSegments, i);
+			int32 v3 = forkRing(ring, parentBase, parentSegments, (step * parentSegments + aSegments / 2) / aSegments % parentSegments);
+			int32 entry = (zero + (fromZero * parentSegments + aSegments / 2) / aSegments) % parentSegments;
+
+			float len = length(sub(mVert[v1], mVert[v3])) * UVScale;
+			fvec2 uv = mUV[forkRing(ring, parentBase, parentSegments, entry)];
 
-			mNormal[mFace[i].x].x += norm.x;
-			mNormal[mFace[i].x].y += norm.y;
-			mNormal[mFace[i].x].z += norm.z;
-			mNormal[mFace[i].y].x += norm.x;
-			mNormal[mFace[i].y].y += norm.y;
-			mNormal[mFace[i].y].z += norm.z;
-			mNormal[mFace[i].z].x += norm.x;
-			mNormal[mFace[i].z].y += norm.y;
-			mNormal[mFace[i].z].z += norm.z;
+			mUV[v1] = { uv.u, uv.v + len * mProperties.mVMultiplier };
+			mUV[forkRing(2, base, aSegments, i)] = { uv.u, uv.v + len * mProperties.mVMultiplier };
 		}
+	}
 
-		for (i = 0; i < (int)mVertCount; i++)
+	void Tree::capPrunedBranch(int32 aBranch)
+	{
+		// A branch without bark leaves a hole in its parent's fork, closed with a fan
+		// across the parent ring. When its sibling has none either the two
+		// fans would meet on the shared arc, so the first child closes the
+		// whole end ring of the parent in one fan and the second adds none.
+		// Its remaining faces, and all of those of the rest of the subtree,
+		// are marked for dropPrunedFaces.
+		Skeleton &sk = mSkeleton;
+		int32 parent = sk.mParent[aBranch];
+		int32 face = sk.faceBase(aBranch);
+		int32 end = face + sk.mLevelFaceStride[sk.mLevel[aBranch]];
+		mSegOffset[aBranch] = 0;
+		bool second = sk.mChild1[parent] == aBranch;
+		bool bothDropped = sk.barkDropped(second ? sk.mChild0[parent] : sk.mChild1[parent]);
+		if (!sk.barkDropped(parent) && !(second && bothDropped))
 		{
-			float d = 1.0f / normalCount[i];
-			mNormal[i].x *= d;
-			mNormal[i].y *= d;
-			mNormal[i].z *= d;
+			int32 segments = sk.mLevelSegments[sk.mLevel[parent]];
+			int32 ring = bothDropped ? 0 : 1 + second;
+			int32 parentBase = sk.vertBase(parent);
+			int32 first = forkRing(ring, parentBase, segments, 0);
+			int32 i;
+			for (i = 1; i < segments - 1; i++)
+			{
+				mFace[face++] = { first, forkRing(ring, parentBase, segments, i + 1), forkRing(ring, parentBase, segments, i) };
+			}
+		}
+		for (; face < end; face++)
+		{
+			mFace[face] = { -1, -1, -1 };
 		}
-
-		delete[] normalCount;
 	}
 
-	void Tree::doFaces(Branch *aBranch)
+	void Tree::dropPrunedFaces()
 	{
-		if (!aBranch)
+		int32 count = 0;
+		int32 level, i;
+		for (level = 0; level < mFaceLevelCount; level++)
 		{
-			aBranch = mRoot;
+			for (i = mSkeleton.mLevelFaceBase[level]; i < mSkeleton.mLevelFaceBase[level + 1]; i++)
+			{
+				if (mFace[i].x >= 0)
+				{
+					mFace[count++] = mFace[i];
+				}
+			}
+			mLevelFaceEnd[level] = count;
 		}
-		int32 segments = mProperties.mSegments;
+		mFaceCount = count;
+	}
+
+	void Tree::dropHiddenTwigs()
+	{
+		// Every leaf has its own run of twig vertices and faces; the runs of
+		// the twigs that are kept move down over the others
+		Skeleton &sk = mSkeleton;
+		int32 leaves = sk.mLevelCount - 1;
+		int32 vert = 0;
+		int32 face = 0;
 		int32 i;
-		if (!aBranch->mParent)
+		if (!mProperties.mTwigs)
 		{
-			fvec3 tangent = normalize(cross(sub(aBranch->mChild0->mHead, aBranch->mHead), sub(aBranch->mChild1->mHead, aBranch->mHead)));
-			fvec3 normal = normalize(aBranch->mHead);
-			fvec3 left = { -1, 0, 0 };
-			float angle = FMath::Acos(dot(tangent, left));
-			if (dot(cross(left, tangent), normal) > 0)
+			return;
+		}
+		if (mTwigInstance)
+		{
+			int32 count = 0;
+			for (i = mSweepStart[leaves]; i < mSweepEnd[leaves]; i++)
 			{
-				angle = 2 * M_PI - angle;
+				if (sk.hasTwig(i))
+				{
+					mTwigInstance[count++] = mTwigInstance[i - sk.mTwigOrigin];
+				}
 			}
-			int32 segOffset = (int)floor(0.5f + (angle / M_PI / 2 * segments));
-			for (i = 0; i < segments; i++)
+			mTwigInstanceCount = count;
+			return;
+		}
+		for (i = mSweepStart[leaves]; i < mSweepEnd[leaves]; i++)
+		{
+			if (!sk.hasTwig(i))
 			{
-				int32 v1 = aBranch->mRing0[i];
-				int32 v2 = aBranch->mRootRing[(i + segOffset + 1) % segments];
-				int32 v3 = aBranch->mRootRing[(i + segOffset) % segments];
-				int32 v4 = aBranch->mRing0[(i + 1) % segments];
-
-				ivec3 a;
-				a = { v1, v4, v3 };
-				mFace[mFaceCount++] = (a);
-				a = { v4, v2, v3 };
-				mFace[mFaceCount++] = (a);
-
-				mUV[(i + segOffset) % segments] = { i / (float)segments, 0 };
+				continue;
+			}
+			int32 from = sk.twigBase(i);
+			int32 shift = from - vert;
+			if (shift)
+			{
+				memmove(mTwigVert + vert, mTwigVert + from, sizeof(fvec3) * 8);
+				memmove(mTwigNormal + vert, mTwigNormal + from, sizeof(fvec3) * 8);
+				memmove(mTwigTangent + vert, mTwigTangent + from, sizeof(fvec4) * 8);
+				memmove(mTwigUV + vert, mTwigUV + from, sizeof(fvec2) * 8);
+			}
+			int32 j;
+			for (j = 0; j < 4; j++)
+			{
+				ivec3 f = mTwigFace[from / 2 + j];
+				mTwigFace[face++] = { f.x - shift, f.y - shift, f.z - shift };
+			}
+			vert += 8;
+		}
+		mTwigVertCount = vert;
+		mTwigFaceCount = face;
+	}
 
-				float len = length(sub(mVert[aBranch->mRing0[i]], mVert[aBranch->mRootRing[(i + segOffset) % segments]])) * mProperties.mVMultiplier;
-				mUV[aBranch->mRing0[i]] = { i / (float)segments, len };
-				mUV[aBranch->mRing2[i]] = { i / (float)segments, len };
+	void Tree::dropUnusedVerts()
+	{
+		// Pruned subtrees leave their ring vertices unused; the rest close up
+		// in their original order
+		int32 *remap = mContext->mArena.alloc<int32>(mVertCount);
+		int32 count = 0;
+		int32 i;
+		for (i = 0; i < mVertCount; i++)
+		{
+			remap[i] = -1;
+		}
+		for (i = 0; i < mFaceCount; i++)
+		{
+			remap[mFace[i].x] = 0;
+			remap[mFace[i].y] = 0;
+			remap[mFace[i].z] = 0;
+		}
+		for (i = 0; i < mVertCount; i++)
+		{
+			if (remap[i] < 0)
+			{
+				continue;
+			}
+			if (count != i)
+			{
+				mVert[count] = mVert[i];
+				mNormal[count] = mNormal[i];
+				mTangent[count] = mTangent[i];
+				mUV[count] = mUV[i];
 			}
+			remap[i] = count++;
 		}
+		for (i = 0; i < mFaceCount; i++)
+		{
+			mFace[i] = { remap[mFace[i].x], remap[mFace[i].y], remap[mFace[i].z] };
+		}
+		mVertCount = count;
+	}
 
-		if (aBranch->mChild0->mRing0 != 0)
+	float cacheMissRatio(const ivec3 *aFace, int32 aFaceCount, int32 aVertCount, int32 aCacheSize)
+	{
+		// A vertex is still cached while fewer than aCacheSize misses came
+		// after its own
+		int32 *missIndex = new int32[aVertCount];
+		int32 misses = 0;
+		int32 i, j;
+		for (i = 0; i < aVertCount; i++)
+		{
+			missIndex[i] = -aCacheSize - 1;
+		}
+		for (i = 0; i < aFaceCount; i++)
 		{
-			int32 segOffset0 = -1, segOffset1 = -1;
-			float match0 = 0;
-			int32 match1 = 0;
+			int32 corner[3] = { aFace[i].x, aFace[i].y, aFace[i].z };
+			for (j = 0; j < 3; j++)
+			{
+				if (misses - missIndex[corner[j]] > aCacheSize)
+				{
+					missIndex[corner[j]] = misses++;
+				}
+			}
+		}
+		delete[] missIndex;
+		return aFaceCount ? (float)misses / aFaceCount : 0;
+	}
 
-			fvec3 v1 = normalize(sub(mVert[aBranch->mRing1[0]], aBranch->mHead));
-			fvec3 v2 = normalize(sub(mVert[aBranch->mRing2[0]], aBranch->mHead));
+	static const int32 ForsythCacheSize = 32;
 
-			v1 = scaleInDirection(v1, normalize(sub(aBranch->mChild0->mHead, aBranch->mHead)), 0);
-			v2 = scaleInDirection(v2, normalize(sub(aBranch->mChild1->mHead, aBranch->mHead)), 0);
+	static float forsythScore(int32 aCachePos, int32 aValence)
+	{
+		if (aValence == 0)
+		{
+			return -1;
+		}
+		float score = 0;
+		if (aCachePos >= 0)
+		{
+			// The last triangle's vertices score a fixed amount, using them
+			// again right away gains less than the cache position says
+			score = aCachePos < 3 ? 0.75f : FMath::Pow(1 - (float)(aCachePos - 3) / (ForsythCacheSize - 3), 1.5f);
+		}
+		// Vertices with few triangles left are worth finishing off
+		return score + 2 / FMath::Sqrt((float)aValence);
+	}
 
-			for (i = 0; i < segments; i++)
+	// Tom Forsyth's linear-speed vertex cache optimization: triangles go out
+	// greedily by the score of their vertices in a simulated LRU cache, only
+	// looking at the triangles around the vertices the last one touched
+	static void optimizeFaceOrder(ivec3 *aFace, int32 aFaceCount, int32 aVertCount, Arena &aArena)
+	{
+		int32 *valence = aArena.alloc<int32>(aVertCount);
+		int32 *adjStart = aArena.alloc<int32>(aVertCount + 1);
+		int32 *adj = aArena.alloc<int32>(aFaceCount * 3);
+		int32 *cachePos = aArena.alloc<int32>(aVertCount);
+		float *vertScore = aArena.alloc<float>(aVertCount);
+		float *faceScore = aArena.alloc<float>(aFaceCount);
+		uint8 *emitted = aArena.alloc<uint8>(aFaceCount);
+		ivec3 *order = aArena.alloc<ivec3>(aFaceCount);
+		const int32 *corner = &aFace[0].x;
+		int32 i, j;
+
+		memset(valence, 0, sizeof(int32) * aVertCount);
+		for (i = 0; i < aFaceCount * 3; i++)
+		{
+			valence[corner[i]]++;
+		}
+		adjStart[0] = 0;
+		for (i = 0; i < aVertCount; i++)
+		{
+			adjStart[i + 1] = adjStart[i] + valence[i];
+			valence[i] = 0;
+		}
+		for (i = 0; i < aFaceCount * 3; i++)
+		{
+			adj[adjStart[corner[i]] + valence[corner[i]]++] = i / 3;
+		}
+		for (i = 0; i < aVertCount; i++)
+		{
+			cachePos[i] = -1;
+			vertScore[i] = forsythScore(-1, valence[i]);
+		}
+		for (i = 0; i < aFaceCount; i++)
+		{
+			faceScore[i] = vertScore[aFace[i].x] + vertScore[aFace[i].y] + vertScore[aFace[i].z];
+		}
+		memset(emitted, 0, aFaceCount);
+
+		int32 cache[ForsythCacheSize + 3];
+		int32 cacheCount = 0;
+		int32 scan = 0;
+		int32 best = -1;
+		int32 n;
+		for (n = 0; n < aFaceCount; n++)
+		{
+			if (best < 0)
+			{
+				// Nothing around the cache is left, carry on in the old order
+				while (emitted[scan])
+				{
+					scan++;
+				}
+				best = scan;
+			}
+			emitted[best] = 1;
+			order[n] = aFace[best];
+
+			// The triangle's vertices go to the front of the cache and it
+			// leaves their triangle lists
+			int32 next[ForsythCacheSize + 3];
+			int32 nextCount = 0;
+			for (i = 0; i < 3; i++)
 			{
-				fvec3 d = normalize(sub(mVert[aBranch->mChild0->mRing0[i]], aBranch->mChild0->mHead));
-				float l = dot(d, v1);
-				if (segOffset0 == -1 || l > match0)
+				int32 v = corner[best * 3 + i];
+				int32 *list = adj + adjStart[v];
+				j = 0;
+				while (list[j] != best)
 				{
-					match0 = l;
-					segOffset0 = segments - i;
+					j++;
 				}
-				d = normalize(sub(mVert[aBranch->mChild1->mRing0[i]], aBranch->mChild1->mHead));
-				l = dot(d, v2);
-				if (segOffset1 == -1 || l > match1)
+				list[j] = list[--valence[v]];
+				if (cachePos[v] != -2)
 				{
-					match1 = l;
-					segOffset1 = segments - i;
+					cachePos[v] = -2;
+					next[nextCount++] = v;
+				}
+			}
+			for (i = 0; i < cacheCount; i++)
+			{
+				if (cachePos[cache[i]] != -2)
+				{
+					next[nextCount++] = cache[i];
 				}
 			}
 
-			float UVScale = mProperties.mMaxRadius / aBranch->mRadius;
-
-			for (i = 0; i < segments; i++)
+			// Rescore the vertices that moved, including those that fell out
+			// of the cache, and pick the best triangle around them
+			float bestScore = -1;
+			best = -1;
+			for (i = 0; i < nextCount; i++)
 			{
-				int32 v1 = aBranch->mChild0->mRing0[i];
-				int32 v2 = aBranch->mRing1[(i + segOffset0 + 1) % segments];
-				int32 v3 = aBranch->mRing1[(i + segOffset0) % segments];
-				int32 v4 = aBranch->mChild0->mRing0[(i + 1) % segments];
-				ivec3 a;
-				a = { v1, v4, v3 };
-				mFace[mFaceCount++] = (a);
-				a = { v4, v2, v3 };
-				mFace[mFaceCount++] = (a);
+				cachePos[next[i]] = i < ForsythCacheSize ? i : -1;
+				vertScore[next[i]] = forsythScore(cachePos[next[i]], valence[next[i]]);
+			}
+			for (i = 0; i < nextCount; i++)
+			{
+				int32 v = next[i];
+				for (j = 0; j < valence[v]; j++)
+				{
+					int32 f = adj[adjStart[v] + j];
+					faceScore[f] = vertScore[aFace[f].x] + vertScore[aFace[f].y] + vertScore[aFace[f].z];
+					if (faceScore[f] > bestScore)
+					{
+						bestScore = faceScore[f];
+						best = f;
+					}
+				}
+			}
+			cacheCount = FMath::Min(nextCount, (int32)ForsythCacheSize);
+			memcpy(cache, next, sizeof(int32) * cacheCount);
+		}
+		memcpy(aFace, order, sizeof(ivec3) * aFaceCount);
+	}
 
-				v1 = aBranch->mChild1->mRing0[i];
-				v2 = aBranch->mRing2[(i + segOffset1 + 1) % segments];
-				v3 = aBranch->mRing2[(i + segOffset1) % segments];
-				v4 = aBranch->mChild1->mRing0[(i + 1) % segments];
+	// Renumbers the vertices in the order the faces first use them, unused
+	// ones go last; returns the new index of every old vertex
+	static int32 *orderVertsByFirstUse(ivec3 *aFace, int32 aFaceCount, int32 aVertCount, Arena &aArena)
+	{
+		int32 *remap = aArena.alloc<int32>(aVertCount);
+		int32 *corner = &aFace[0].x;
+		int32 count = 0;
+		int32 i;
+		for (i = 0; i < aVertCount; i++)
+		{
+			remap[i] = -1;
+		}
+		for (i = 0; i < aFaceCount * 3; i++)
+		{
+			if (remap[corner[i]] < 0)
+			{
+				remap[corner[i]] = count++;
+			}
+			corner[i] = remap[corner[i]];
+		}
+		for (i = 0; i < aVertCount; i++)
+		{
+			if (remap[i] < 0)
+			{
+				remap[i] = count++;
+			}
+		}
+		return remap;
+	}
 
-				a = { v1, v2, v3 };
-				mFace[mFaceCount++] = (a);
-				a = { v1, v4, v2 };
-				mFace[mFaceCount++] = (a);
+	template <typename T> static void permute(T *aData, const int32 *aRemap, int32 aCount, Arena &aArena)
+	{
+		T *copy = aArena.alloc<T>(aCount);
+		memcpy(copy, aData, sizeof(T) * aCount);
+		int32 i;
+		for (i = 0; i < aCount; i++)
+		{
+			aData[aRemap[i]] = copy[i];
+		}
+	}
 
-				float len1 = length(sub(mVert[aBranch->mChild0->mRing0[i]], mVert[aBranch->mRing1[(i + segOffset0) % segments]])) * UVScale;
-				fvec2 uv1 = mUV[aBranch->mRing1[(i + segOffset0 - 1) % segments]];
+	// Faces are only reordered within the blocks that end at aBlockEnd
+	static void optimizeMesh(fvec3 *aVert, fvec3 *aNormal, fvec4 *aTangent, fvec2 *aUV, int32 aVertCount, ivec3 *aFace, int32 aFaceCount, const int32 *aBlockEnd, int32 aBlockCount, Arena &aArena)
+	{
+		if (aFaceCount == 0)
+		{
+			return;
+		}
+		int32 start = 0;
+		int32 i;
+		for (i = 0; i < aBlockCount; i++)
+		{
+			optimizeFaceOrder(aFace + start, aBlockEnd[i] - start, aVertCount, aArena);
+			start = aBlockEnd[i];
+		}
+		int32 *remap = orderVertsByFirstUse(aFace, aFaceCount, aVertCount, aArena);
+		permute(aVert, remap, aVertCount, aArena);
+		permute(aNormal, remap, aVertCount, aArena);
+		permute(aTangent, remap, aVertCount, aArena);
+		permute(aUV, remap, aVertCount, aArena);
+	}
 
-				mUV[aBranch->mChild0->mRing0[i]] = { uv1.u, uv1.v + len1 * mProperties.mVMultiplier };
-				mUV[aBranch->mChild0->mRing2[i]] = { uv1.u, uv1.v + len1 * mProperties.mVMultiplier };
+	void Tree::optimizeVertexCache()
+	{
+		const int32 cacheSize = VertexCacheReport::CacheSize;
+		mCacheReport.mBarkBefore = cacheMissRatio(mFace, mFaceCount, mVertCount, cacheSize);
+		mCacheReport.mTwigBefore = cacheMissRatio(mTwigFace, mTwigFaceCount, mTwigVertCount, cacheSize);
+
+		// The seam duplicates fixUVs put at the end move next to their
+		// neighbours along with everything else
+		// Progressive trees keep their levels apart; twigs share no vertices,
+		// so their order survives either way
+		if (mProperties.mProgressiveOrder)
+		{
+			optimizeMesh(mVert, mNormal, mTangent, mUV, mVertCount, mFace, mFaceCount, mLevelFaceEnd, mFaceLevelCount, mContext->mArena);
+		}
+		else
+		{
+			optimizeMesh(mVert, mNormal, mTangent, mUV, mVertCount, mFace, mFaceCount, &mFaceCount, 1, mContext->mArena);
+		}
+		optimizeMesh(mTwigVert, mTwigNormal, mTwigTangent, mTwigUV, mTwigVertCount, mTwigFace, mTwigFaceCount, &mTwigFaceCount, 1, mContext->mArena);
 
-				float len2 = length(sub(mVert[aBranch->mChild1->mRing0[i]], mVert[aBranch->mRing2[(i + segOffset1) % segments]])) * UVScale;
-				fvec2 uv2 = mUV[aBranch->mRing2[(i + segOffset1 - 1) % segments]];
+		mCacheReport.mBarkAfter = cacheMissRatio(mFace, mFaceCount, mVertCount, cacheSize);
+		mCacheReport.mTwigAfter = cacheMissRatio(mTwigFace, mTwigFaceCount, mTwigVertCount, cacheSize);
+	}
 
-				mUV[aBranch->mChild1->mRing0[i]] = { uv2.u, uv2.v + len2 * mProperties.mVMultiplier };
-				mUV[aBranch->mChild1->mRing2[i]] = { uv2.u, uv2.v + len2 * mProperties.mVMultiplier };
+	void Tree::orderTwigsByImportance()
+	{
+		// Every twig is a run of 8 vertices and 4 faces, or an instance. The
+		// twigs furthest from the middle of the crown make its outline and go
+		// first, so shorter prefixes drop the inner ones.
+		int32 count = mTwigInstance ? mTwigInstanceCount : mTwigFaceCount / 4;
+		if (count < 2)
+		{
+			return;
+		}
+		Arena &arena = mContext->mArena;
+		fvec3 lo, hi;
+		int32 i, j;
+		if (mTwigInstance)
+		{
+			twigInstanceBounds(mTwigInstance, count, lo, hi);
+		}
+		else
+		{
+			lo = { FLT_MAX, FLT_MAX, FLT_MAX };
+			hi = { -FLT_MAX, -FLT_MAX, -FLT_MAX };
+			for (i = 0; i < mTwigVertCount; i++)
+			{
+				fvec3 v = mTwigVert[i];
+				lo = { FMath::Min(lo.x, v.x), FMath::Min(lo.y, v.y), FMath::Min(lo.z, v.z) };
+				hi = { FMath::Max(hi.x, v.x), FMath::Max(hi.y, v.y), FMath::Max(hi.z, v.z) };
 			}
+		}
+		fvec3 center = scaleVec(add(lo, hi), 0.5f);
 
-			doFaces(aBranch->mChild0);
-			doFaces(aBranch->mChild1);
+		float *distance = arena.alloc<float>(count);
+		int32 *order = arena.alloc<int32>(count);
+		for (i = 0; i < count; i++)
+		{
+			fvec3 sum = { 0, 0, 0 };
+			if (mTwigInstance)
+			{
+				sum = scaleVec(twigCardCenter(mTwigInstance[i]), 8);
+			}
+			else
+			{
+				for (j = 0; j < 8; j++)
+				{
+					sum = add(sum, mTwigVert[i * 8 + j]);
+				}
+			}
+			fvec3 d = sub(scaleVec(sum, 0.125f), center);
+			distance[i] = dot(d, d);
+			order[i] = i;
 		}
-		else
+		Sort(order, count, [distance](int32 a, int32 b)
 		{
-			for (i = 0; i < segments; i++)
+			return distance[a] > distance[b] || (distance[a] == distance[b] && a < b);
+		});
+
+		if (mTwigInstance)
+		{
+			TwigInstance *instance = arena.alloc<TwigInstance>(count);
+			memcpy(instance, mTwigInstance, sizeof(TwigInstance) * count);
+			for (i = 0; i < count; i++)
 			{
-				ivec3 a;
-				a = {
-					aBranch->mChild0->mEnd,
-					aBranch->mRing1[(i + 1) % segments],
-					aBranch->mRing1[i]
-				};
-				mFace[mFaceCount++] = (a);
-				a = {
-					aBranch->mChild1->mEnd,
-					aBranch->mRing2[(i + 1) % segments],
-					aBranch->mRing2[i]
-				};
-				mFace[mFaceCount++] = (a);
+				mTwigInstance[i] = instance[order[i]];
+			}
+			return;
+		}
 
-				float len = length(sub(mVert[aBranch->mChild0->mEnd], mVert[aBranch->mRing1[i]]));
-				mUV[aBranch->mChild0->mEnd] = { i / (float)segments - 1, len * mProperties.mVMultiplier };
-				len = length(sub(mVert[aBranch->mChild1->mEnd], mVert[aBranch->mRing2[i]]));
-				mUV[aBranch->mChild1->mEnd] = { i / (float)segments, len * mProperties.mVMultiplier };
+		// Vertex runs move as a whole, faces follow them
+		int32 *remap = arena.alloc<int32>(count * 8);
+		ivec3 *face = arena.alloc<ivec3>(count * 4);
+		memcpy(face, mTwigFace, sizeof(ivec3) * count * 4);
+		for (i = 0; i < count; i++)
+		{
+			for (j = 0; j < 8; j++)
+			{
+				remap[order[i] * 8 + j] = i * 8 + j;
+			}
+			for (j = 0; j < 4; j++)
+			{
+				ivec3 f = face[order[i] * 4 + j];
+				mTwigFace[i * 4 + j] = { remap[f.x], remap[f.y], remap[f.z] };
 			}
 		}
+		permute(mTwigVert, remap, count * 8, arena);
+		permute(mTwigNormal, remap, count * 8, arena);
+		permute(mTwigTangent, remap, count * 8, arena);
+		permute(mTwigUV, remap, count * 8, arena);
 	}
 
-	void Tree::createTwigs(Branch *aBranch)
+	void Tree::createTwigs()
 	{
-		if (!aBranch)
+		if (!mProperties.mTwigs)
 		{
-			aBranch = mRoot;
+			return;
 		}
-
-		if (!aBranch->mChild0)
+		int32 leaves = mSkeleton.mLevelCount - 1;
+		forRange(mSweepStart[leaves], mSweepEnd[leaves], isParallel(mProperties.mParallelLevel, leaves), [&](int32 aBranch)
 		{
-			fvec3 tangent = normalize(cross(sub(aBranch->mParent->mChild0->mHead, aBranch->mParent->mHead), sub(aBranch->mParent->mChild1->mHead, aBranch->mParent->mHead)));
-			fvec3 binormal = normalize(sub(aBranch->mHead, aBranch->mParent->mHead));
-			//fvec3 normal = cross(tangent, binormal); //never used
-
-			int32 vert1 = mTwigVertCount;
-			mTwigVert[mTwigVertCount++] = (add(add(aBranch->mHead, scaleVec(tangent, mProperties.mTwigScale)), scaleVec(binormal, mProperties.mTwigScale * 2 - aBranch->mLength)));
-			int32 vert2 = mTwigVertCount;
-			mTwigVert[mTwigVertCount++] = (add(add(aBranch->mHead, scaleVec(tangent, -mProperties.mTwigScale)), scaleVec(binormal, mProperties.mTwigScale * 2 - aBranch->mLength)));
-			int32 vert3 = mTwigVertCount;
-			mTwigVert[mTwigVertCount++] = (add(add(aBranch->mHead, scaleVec(tangent, -mProperties.mTwigScale)), scaleVec(binormal, -aBranch->mLength)));
-			int32 vert4 = mTwigVertCount;
-			mTwigVert[mTwigVertCount++] = (add(add(aBranch->mHead, scaleVec(tangent, mProperties.mTwigScale)), scaleVec(binormal, -aBranch->mLength)));
+			if (!mSkeleton.hasTwig(aBranch))
+			{
+				return;
+			}
+			if (mTwigInstance)
+			{
+				createTwigInstance(aBranch);
+			}
+			else
+			{
+				createTwig(aBranch);
+			}
+		});
+	}
 
-			int32 vert8 = mTwigVertCount;
-			mTwigVert[mTwigVertCount++] = (add(add(aBranch->mHead, scaleVec(tangent, mProperties.mTwigScale)), scaleVec(binormal, mProperties.mTwigScale * 2 - aBranch->mLength)));
-			int32 vert7 = mTwigVertCount;
-			mTwigVert[mTwigVertCount++] = (add(add(aBranch->mHead, scaleVec(tangent, -mProperties.mTwigScale)), scaleVec(binormal, mProperties.mTwigScale * 2 - aBranch->mLength)));
-			int32 vert6 = mTwigVertCount;
-			mTwigVert[mTwigVertCount++] = (add(add(aBranch->mHead, scaleVec(tangent, -mProperties.mTwigScale)), scaleVec(binormal, -aBranch->mLength)));
-			int32 vert5 = mTwigVertCount;
-			mTwigVert[mTwigVertCount++] = (add(add(aBranch->mHead, scaleVec(tangent, mProperties.mTwigScale)), scaleVec(binormal, -aBranch->mLength)));
+	void Tree::createTwigInstance(int32 aBranch)
+	{
+		// The card createTwig() would write: twig scale wide to either side of
+		// the branch and twice that high, from where the leaf branch starts
+		Skeleton &sk = mSkeleton;
+		int32 parent = sk.mParent[aBranch];
+		fvec3 head = sk.mHead[aBranch];
+		fvec3 tangent = normalize(cross(sub(sk.mHead[sk.mChild0[parent]], sk.mHead[parent]), sub(sk.mHead[sk.mChild1[parent]], sk.mHead[parent])));
+		fvec3 binormal = normalize(sub(head, sk.mHead[parent]));
+
+		TwigInstance &instance = mTwigInstance[aBranch - sk.mTwigOrigin];
+		instance.mPosition = sub(head, scaleVec(binormal, sk.mLength[aBranch]));
+		instance.mScale = mProperties.mTwigScale;
+		instance.mRotation = basisRotation(tangent, binormal, cross(tangent, binormal));
+	}
 
-			mTwigFace[mTwigFaceCount++] = { vert1, vert2, vert3 };
-			mTwigFace[mTwigFaceCount++] = { vert4, vert1, vert3 };			
-			mTwigFace[mTwigFaceCount++] = { vert6, vert7, vert8 };			
-			mTwigFace[mTwigFaceCount++] = { vert6, vert8, vert5 };
+	void Tree::writeTwigCard(MeshStreams &aStreams, bool aSwapYZ)
+	{
+		// createTwig()'s card with the tangent along x and the leaf branch
+		// along y, front then back. Swapping two axes mirrors the instance
+		// frames, which the rotations cannot do, so the card is mirrored
+		// across its plane instead: normals and bitangents turn over.
+		static const fvec3 vert[8] = { { 1, 2, 0 }, { -1, 2, 0 }, { -1, 0, 0 }, { 1, 0, 0 }, { 1, 2, 0 }, { -1, 2, 0 }, { -1, 0, 0 }, { 1, 0, 0 } };
+		static const fvec2 uv[8] = { { 0, 0 }, { 1, 0 }, { 1, 1 }, { 0, 1 }, { 0, 0 }, { 1, 0 }, { 1, 1 }, { 0, 1 } };
+		static const ivec3 face[4] = { { 0, 1, 2 }, { 3, 0, 2 }, { 6, 5, 4 }, { 6, 4, 7 } };
+		float flip = aSwapYZ ? -1.0f : 1.0f;
+		fvec3 normal[8];
+		fvec4 tangent[8];
+		int32 i;
+		for (i = 0; i < 8; i++)
+		{
+			float side = i < 4 ? flip : -flip;
+			normal[i] = { 0, 0, side };
+			tangent[i] = { -1, 0, 0, side };
+		}
+		writeStreams(aStreams, false, 1, vert, normal, tangent, uv, 8, 8, face, 4, 0);
+	}
 
-			fvec3 normal = normalize(cross(sub(mTwigVert[vert1], mTwigVert[vert3]), sub(mTwigVert[vert2], mTwigVert[vert3])));
-			fvec3 normal2 = normalize(cross(sub(mTwigVert[vert7], mTwigVert[vert6]), sub(mTwigVert[vert8], mTwigVert[vert6])));
+	void Tree::createTwig(int32 aBranch)
+	{
+		Skeleton &sk = mSkeleton;
+		int32 parent = sk.mParent[aBranch];
+		fvec3 head = sk.mHead[aBranch];
+		float branchLength = sk.mLength[aBranch];
+		fvec3 tangent = normalize(cross(sub(sk.mHead[sk.mChild0[parent]], sk.mHead[parent]), sub(sk.mHead[sk.mChild1[parent]], sk.mHead[parent])));
+		fvec3 binormal = normalize(sub(head, sk.mHead[parent]));
+		//fvec3 normal = cross(tangent, binormal); //never used
+
+		int32 vert = sk.twigBase(aBranch);
+		int32 face = vert / 2;
+
+		int32 vert1 = vert;
+		mTwigVert[vert++] = (add(add(head, scaleVec(tangent, mProperties.mTwigScale)), scaleVec(binormal, mProperties.mTwigScale * 2 - branchLength)));
+		int32 vert2 = vert;
+		mTwigVert[vert++] = (add(add(head, scaleVec(tangent, -mProperties.mTwigScale)), scaleVec(binormal, mProperties.mTwigScale * 2 - branchLength)));
+		int32 vert3 = vert;
+		mTwigVert[vert++] = (add(add(head, scaleVec(tangent, -mProperties.mTwigScale)), scaleVec(binormal, -branchLength)));
+		int32 vert4 = vert;
+		mTwigVert[vert++] = (add(add(head, scaleVec(tangent, mProperties.mTwigScale)), scaleVec(binormal, -branchLength)));
+
+		int32 vert8 = vert;
+		mTwigVert[vert++] = (add(add(head, scaleVec(tangent, mProperties.mTwigScale)), scaleVec(binormal, mProperties.mTwigScale * 2 - branchLength)));
+		int32 vert7 = vert;
+		mTwigVert[vert++] = (add(add(head, scaleVec(tangent, -mProperties.mTwigScale)), scaleVec(binormal, mProperties.mTwigScale * 2 - branchLength)));
+		int32 vert6 = vert;
+		mTwigVert[vert++] = (add(add(head, scaleVec(tangent, -mProperties.mTwigScale)), scaleVec(binormal, -branchLength)));
+		int32 vert5 = vert;
+		mTwigVert[vert++] = (add(add(head, scaleVec(tangent, mProperties.mTwigScale)), scaleVec(binormal, -branchLength)));
+
+		mTwigFace[face++] = { vert1, vert2, vert3 };
+		mTwigFace[face++] = { vert4, vert1, vert3 };
+		mTwigFace[face++] = { vert6, vert7, vert8 };
+		mTwigFace[face++] = { vert6, vert8, vert5 };
+
+		fvec3 normal = normalize(cross(sub(mTwigVert[vert1], mTwigVert[vert3]), sub(mTwigVert[vert2], mTwigVert[vert3])));
+		fvec3 normal2 = normalize(cross(sub(mTwigVert[vert7], mTwigVert[vert6]), sub(mTwigVert[vert8], mTwigVert[vert6])));
+
+		mTwigNormal[vert1] = (normal);
+		mTwigNormal[vert2] = (normal);
+		mTwigNormal[vert3] = (normal);
+		mTwigNormal[vert4] = (normal);
+
+		mTwigNormal[vert8] = (normal2);
+		mTwigNormal[vert7] = (normal2);
+		mTwigNormal[vert6] = (normal2);
+		mTwigNormal[vert5] = (normal2);
+
+		// U runs from vert1 to vert2 and V from vert1 to vert4 on both cards
+		fvec3 tangent3 = normalize(sub(mTwigVert[vert2], mTwigVert[vert1]));
+		fvec3 vdir = sub(mTwigVert[vert4], mTwigVert[vert1]);
+		fvec4 tangent1 = { tangent3.x, tangent3.y, tangent3.z, dot(cross(normal, tangent3), vdir) < 0 ? -1.0f : 1.0f };
+		fvec4 tangent2 = { tangent3.x, tangent3.y, tangent3.z, dot(cross(normal2, tangent3), vdir) < 0 ? -1.0f : 1.0f };
+
+		mTwigTangent[vert1] = tangent1;
+		mTwigTangent[vert2] = tangent1;
+		mTwigTangent[vert3] = tangent1;
+		mTwigTangent[vert4] = tangent1;
+
+		mTwigTangent[vert8] = tangent2;
+		mTwigTangent[vert7] = tangent2;
+		mTwigTangent[vert6] = tangent2;
+		mTwigTangent[vert5] = tangent2;
+
+		mTwigUV[vert1] = { 0, 0 };
+		mTwigUV[vert2] = { 1, 0 };
+		mTwigUV[vert3] = { 1, 1 };
+		mTwigUV[vert4] = { 0, 1 };
+
+		mTwigUV[vert8] = { 0, 0 };
+		mTwigUV[vert7] = { 1, 0 };
+		mTwigUV[vert6] = { 1, 1 };
+		mTwigUV[vert5] = { 0, 1 };
+	}
 
-			mTwigNormal[vert1] = (normal);
-			mTwigNormal[vert2] = (normal);
-			mTwigNormal[vert3] = (normal);
-			mTwigNormal[vert4] = (normal);
+	void Tree::initRingTables()
+	{
+		// Every fork ring of a level sweeps the same angles, so this is the
+		// only place they hit sin and cos. Levels of the same ring size share
+		// their tables.
+		Skeleton &sk = mSkeleton;
+		Arena &arena = mContext->mArena;
+		mRingCos = arena.alloc<float *>(sk.mLevelCount);
+		mRingSin = arena.alloc<float *>(sk.mLevelCount);
+		int32 level;
+		for (level = 0; level < sk.mLevelCount; level++)
+		{
+			int32 segments = sk.mLevelSegments[level];
+			if (level > 0 && segments == sk.mLevelSegments[level - 1])
+			{
+				mRingCos[level] = mRingCos[level - 1];
+				mRingSin[level] = mRingSin[level - 1];
+				continue;
+			}
+			float segmentAngle = M_PI * 2 / (float)segments;
+			float *ringCos = arena.alloc<float>(segments + 3);
+			float *ringSin = arena.alloc<float>(segments + 3);
+			int32 i;
+			for (i = 0; i < segments; i++)
+			{
+				ringCos[i] = FMath::Cos(segmentAngle * i);
+				ringSin[i] = FMath::Sin(segmentAngle * i);
+			}
+			// Padding for the last SIMD batch of an arc, see ringArc
+			for (; i < segments + 3; i++)
+			{
+				ringCos[i] = 0;
+				ringSin[i] = 0;
+			}
+			mRingCos[level] = ringCos;
+			mRingSin[level] = ringSin;
+		}
 
-			mTwigNormal[vert8] = (normal2);
-			mTwigNormal[vert7] = (normal2);
-			mTwigNormal[vert6] = (normal2);
-			mTwigNormal[vert5] = (normal2);
+		// The squashed arc of every fork is measured against a quarter turn
+		mQuarterCos = FMath::Cos(1.57f);
+		mQuarterSin = FMath::Sin(1.57f);
+	}
 
-			mTwigUV[vert1] = { 0, 0 };
-			mTwigUV[vert2] = { 1, 0 };
-			mTwigUV[vert3] = { 1, 1 };
-			mTwigUV[vert4] = { 0, 1 };
+	void Tree::createForks()
+	{
+		Skeleton &sk = mSkeleton;
 
-			mTwigUV[vert8] = { 0, 0 };
-			mTwigUV[vert7] = { 1, 0 };
-			mTwigUV[vert6] = { 1, 1 };
-			mTwigUV[vert5] = { 0, 1 };
-		}
-		else
+		forEachLevel(sk, mSweepStart, mSweepEnd, mProperties.mParallelLevel, [&](int32 aBranch, auto aSegments)
 		{
-			createTwigs(aBranch->mChild0);
-			createTwigs(aBranch->mChild1);
-		}
+			createFork(aBranch, sk.mRadius[aBranch], aSegments);
+		});
 	}
 
-	void Tree::createForks(Branch *aBranch, float aRadius)
+	template <typename Segments>
+	void Tree::createFork(int32 aBranch, float aRadius, Segments aSegments)
 	{
-		if (!aBranch) aBranch = mRoot;
-		if (!aRadius) aRadius = mProperties.mMaxRadius;
+		Skeleton &sk = mSkeleton;
+		int32 vert = sk.vertBase(aBranch);
+		fvec3 head = sk.mHead[aBranch];
 
-		aBranch->mRadius = aRadius;
+		if (sk.barkDropped(aBranch))
+		{
+			return;
+		}
 
-		if (aRadius > aBranch->mLength) aRadius = aBranch->mLength;
+		if (aRadius > sk.mLength[aBranch]) aRadius = sk.mLength[aBranch];
 
-		int32 segments = mProperties.mSegments;
+		const int32 segments = aSegments.get();
 
 		float segmentAngle = M_PI * 2 / (float)segments;
 
-		if (!aBranch->mParent)
+		if (sk.mParent[aBranch] < 0)
 		{
-			aBranch->mRootRing = new int[segments];
-			//create the root of the tree
-			//branch.root = [];
+			//create the root of the tree, its ring takes the first vertices
 			fvec3 axis = { 0, 1, 0 };
 			int32 i;
 			for (i = 0; i < segments; i++)
 			{
 				fvec3 left = { -1, 0, 0 };
 				fvec3 vec = vecAxisAngle(left, axis, -segmentAngle * i);
-				aBranch->mRootRing[i] = mVertCount;
-				mVert[mVertCount++] = (scaleVec(vec, aRadius / mProperties.mRadiusFalloffRate));
+				mVert[i] = (scaleVec(vec, aRadius / mProperties.mRadiusFalloffRate));
+				if (mProperties.mAnalyticNormals)
+				{
+					setRingNormal(i, { 0, 0, 0 });
+				}
 			}
 		}
 
 		//cross the branches to get the left
 		//add the branches to get the up
-		if (aBranch->mChild0)
+		if (sk.mChild0[aBranch] >= 0)
 		{
+			int32 child0 = sk.mChild0[aBranch];
+			int32 child1 = sk.mChild1[aBranch];
 			fvec3 axis;
-			if (aBranch->mParent)
+			if (sk.mParent[aBranch] >= 0)
 			{
-				axis = normalize(sub(aBranch->mHead, aBranch->mParent->mHead));
+				axis = normalize(sub(head, sk.mHead[sk.mParent[aBranch]]));
 			}
 			else
 			{
-				axis = normalize(aBranch->mHead);
+				axis = normalize(head);
 			}
 
-			fvec3 axis1 = normalize(sub(aBranch->mHead, aBranch->mChild0->mHead));
-			fvec3 axis2 = normalize(sub(aBranch->mHead, aBranch->mChild1->mHead));
+			fvec3 axis1 = normalize(sub(head, sk.mHead[child0]));
+			fvec3 axis2 = normalize(sub(head, sk.mHead[child1]));
 			fvec3 tangent = normalize(cross(axis1, axis2));
-			aBranch->mTangent = tangent;
+			sk.mTangent[aBranch] = tangent;
 
 			fvec3 axis3 = normalize(cross(tangent, normalize(add(scaleVec(axis1, -1), scaleVec(axis2, -1)))));
 			fvec3 dir = { axis2.x, 0, axis2.z };
-			fvec3 centerloc = add(aBranch->mHead, scaleVec(dir, -mProperties.mMaxRadius / 2));
-
-			aBranch->mRing0 = new int[segments];
-			aBranch->mRing1 = new int[segments];
-			aBranch->mRing2 = new int[segments];
-
-			int32 ring0count = 0;
-			int32 ring1count = 0;
-			int32 ring2count = 0;
+			fvec3 centerloc = add(head, scaleVec(dir, -mProperties.mMaxRadius / 2));
 
 			float scale = mProperties.mRadiusFalloffRate;
 
-			if (aBranch->mChild0->mTrunktype || aBranch->mTrunktype)
+			if (sk.mTrunktype[child0] || sk.mTrunktype[aBranch])
 			{
 				scale = 1.0f / mProperties.mTaperRate;
 			}
 
-			//main segment ring
-			int32 linch0 = mVertCount;
-			aBranch->mRing0[ring0count++] = linch0;
-			aBranch->mRing2[ring2count++] = linch0;
-			mVert[mVertCount++] = (add(centerloc, scaleVec(tangent, aRadius * scale)));
+			// The fork ring is written as linch0, the first half arc towards
+			// child 1, linch1, the second half arc towards child 0 and finally
+			// the arc between the two children. forkRing() maps ring entries
+			// onto this layout.
+			mVert[vert++] = (add(centerloc, scaleVec(tangent, aRadius * scale)));
 
-			int32 start = mVertCount - 1;
-			fvec3 d1 = vecAxisAngle(tangent, axis2, 1.57f);
+			fvec3 d1 = axisRotate(tangent, axis2, mQuarterCos, mQuarterSin);
 			fvec3 d2 = normalize(cross(tangent, axis));
 			float s = 1 / dot(d1, d2);
+			float radius = aRadius * scale;
+			int32 half = segments / 2;
+			const float *ringCos = mRingCos[sk.mLevel[aBranch]];
+			const float *ringSin = mRingSin[sk.mLevel[aBranch]];
 			int32 i;
-			for (i = 1; i < segments / 2; i++)
-			{
-				fvec3 vec = vecAxisAngle(tangent, axis2, segmentAngle * i);
-				aBranch->mRing0[ring0count++] = start + i;
-				aBranch->mRing2[ring2count++] = start + i;
-				vec = scaleInDirection(vec, d2, s);
-				mVert[mVertCount++] = (add(centerloc, scaleVec(vec, aRadius * scale)));
-			}
-			int32 linch1 = mVertCount;
-			aBranch->mRing0[ring0count++] = linch1;
-			aBranch->mRing1[ring1count++] = linch1;
-			mVert[mVertCount++] = (add(centerloc, scaleVec(tangent, -aRadius * scale)));
-			for (i = segments / 2 + 1; i < segments; i++)
+			ringArc(&mVert[vert], centerloc, radius, tangent, axis2, &d2, s, ringCos + 1, ringSin + 1, half - 1);
+			vert += half - 1;
+			mVert[vert++] = (add(centerloc, scaleVec(tangent, -aRadius * scale)));
+			ringArc(&mVert[vert], centerloc, radius, tangent, axis1, 0, 1, ringCos + half + 1, ringSin + half + 1, segments - half - 1);
+			vert += segments - half - 1;
+			ringArc(&mVert[vert], centerloc, radius, tangent, axis3, 0, 1, ringCos + 1, ringSin + 1, half - 1);
+			vert += half - 1;
+			if (mProperties.mAnalyticNormals)
 			{
-				fvec3 vec = vecAxisAngle(tangent, axis1, segmentAngle * i);
-				aBranch->mRing0[ring0count++] = mVertCount;
-				aBranch->mRing1[ring1count++] = mVertCount;
-				mVert[mVertCount++] = (add(centerloc, scaleVec(vec, aRadius * scale)));
+				for (i = sk.vertBase(aBranch); i < vert; i++)
+				{
+					setRingNormal(i, centerloc);
+				}
 			}
-			aBranch->mRing1[ring1count++] = linch0; 
-			aBranch->mRing2[ring2count++] = linch1; 
-			start = mVertCount - 1;
-			for (i = 1; i < segments / 2; i++)
+		}
+		else
+		{
+			//add points for the ends of braches
+			mVert[vert] = head;
+			if (mProperties.mAnalyticNormals)
 			{
-				fvec3 vec = vecAxisAngle(tangent, axis3, segmentAngle * i);
-				aBranch->mRing1[ring1count++] = start + i;
-				aBranch->mRing2[ring2count++] = start + (segments / 2 - i);
-				fvec3 v = scaleVec(vec, aRadius * scale);
-				mVert[mVertCount++] = (add(centerloc, v));
+				mNormal[vert] = normalize(sub(head, sk.mHead[sk.mParent[aBranch]]));
 			}
+		}
+	}
+
+	void Tree::setRingNormal(int32 aVert, fvec3 aCenter)
+	{
+		mNormal[aVert] = normalize(sub(mVert[aVert], aCenter));
+	}
 
-			//child radius is related to the brans direction and the length of the branch
-			//float length0 = length(sub(aBranch->mHead, aBranch->mChild0->mHead)); // never used
-			//float length1 = length(sub(aBranch->mHead, aBranch->mChild1->mHead)); // never used
+	void Tree::calcTangents()
+	{
+		int32 segments = mSkeleton.mLevelSegments[0];
+		fvec3 up = { 0, 1, 0 };
+		int32 i;
 
-			float radius0 = 1 * aRadius * mProperties.mRadiusFalloffRate;
-			float radius1 = 1 * aRadius * mProperties.mRadiusFalloffRate;
-			if (aBranch->mChild0->mTrunktype)
+		// The root ring belongs to the trunk's first fork
+		if (mSweepStart[0] == 0 && mSweepEnd[0] > 0)
+		{
+			for (i = 0; i < segments; i++)
 			{
-				radius0 = aRadius * mProperties.mTaperRate;
+				setRingTangent(i, (i + segments - 1) % segments, (i + 1) % segments, up);
 			}
-			createForks(aBranch->mChild0, radius0);
-			createForks(aBranch->mChild1, radius1);
 		}
-		else
+
+		// Every branch only touches its own vertices
+		forEachLevel(mSkeleton, mSweepStart, mSweepEnd, mProperties.mParallelLevel, [&](int32 aBranch, auto aSegments)
 		{
-			//add points for the ends of braches
-			aBranch->mEnd = mVertCount;
-			//branch.head=add(branch.head,scaleVec([this.properties.xBias,this.properties.yBias,this.properties.zBias],branch.length*3));
-			mVert[mVertCount++] = (aBranch->mHead);
+			calcBranchTangents(aBranch, aSegments);
+		});
+	}
+
+	template <typename Segments>
+	void Tree::calcBranchTangents(int32 aBranch, Segments aSegments)
+	{
+		Skeleton &sk = mSkeleton;
+		const int32 segments = aSegments.get();
+		int32 base = sk.vertBase(aBranch);
+		int32 parent = sk.mParent[aBranch];
+		int32 j;
+
+		if (sk.barkDropped(aBranch))
+		{
+			return;
 		}
+
+		if (sk.mChild0[aBranch] < 0)
+		{
+			// The parent fork tangent is perpendicular to both children
+			fvec3 n = normalize(mNormal[base]);
+			fvec3 t = sk.mTangent[parent];
+			t = normalize(sub(t, scaleVec(n, dot(n, t))));
+			mTangent[base] = { t.x, t.y, t.z, 1 };
+			return;
+		}
+
+		fvec3 axis = normalize(parent >= 0 ? sub(sk.mHead[aBranch], sk.mHead[parent]) : sk.mHead[aBranch]);
+		for (j = 0; j < segments; j++)
+		{
+			setRingTangent(
+				forkRing(0, base, segments, j),
+				forkRing(0, base, segments, (j + segments - 1) % segments),
+				forkRing(0, base, segments, (j + 1) % segments),
+				axis);
+		}
+		// The arc between the children is only part of ring 2
+		for (j = segments / 2 + 1; j < segments; j++)
+		{
+			setRingTangent(
+				forkRing(2, base, segments, j),
+				forkRing(2, base, segments, j - 1),
+				forkRing(2, base, segments, (j + 1) % segments),
+				axis);
+		}
+	}
+
+	void Tree::setRingTangent(int32 aVert, int32 aPrev, int32 aNext, fvec3 aAxis)
+	{
+		// U goes around the ring, but child rings inherit a folded copy of
+		// their parent's U so it does not always go the same way. Follow its
+		// slope between the two ring neighbours, unwrapping the seam.
+		float du = mUV[aNext].u - mUV[aPrev].u;
+		if (du > 0.5f) du -= 1;
+		if (du < -0.5f) du += 1;
+
+		fvec3 n = normalize(mNormal[aVert]);
+		fvec3 t = sub(mVert[aNext], mVert[aPrev]);
+		if (du < 0)
+		{
+			t = scaleVec(t, -1);
+		}
+		t = sub(t, scaleVec(n, dot(n, t)));
+		if (length(t) == 0)
+		{
+			t = cross(n, aAxis);
+		}
+		t = normalize(t);
+
+		// V grows along the branch
+		float w = dot(cross(n, t), aAxis) < 0 ? -1.0f : 1.0f;
+		mTangent[aVert] = { t.x, t.y, t.z, w };
 	}
 }
@@ -30,6 +30,12 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 #include "CoreMinimal.h"
 
+// Builds fork rings four vertices at a time with UE's vector intrinsics
+// (SSE or NEON); set to 0 to force the scalar path
+#ifndef PROCTREE_SIMD
+#define PROCTREE_SIMD PLATFORM_ENABLE_VECTORINTRINSICS
+#endif
+
 namespace Proctree
 {
 	typedef struct
@@ -44,11 +50,61 @@ namespace Proctree
 	} fvec2;
 
 
+	typedef struct
+	{
+		float x, y, z, w;
+	} fvec4;
+
+
 	typedef struct
 	{
 		int32 x, y, z;
 	} ivec3;
 
+	// Bump allocator for the branch skeleton and scratch of a tree. Memory is carved
+	// out of large blocks; reset() rewinds to the first block in O(1) and keeps
+	// the blocks around, so a warmed up arena never hits the heap. rewind()
+	// releases everything allocated since a mark() the same way.
+	class Arena
+	{
+		struct Block
+		{
+			Block *mNext;
+			SIZE_T mSize;
+		};
+	public:
+		struct Marker
+		{
+			Block *mBlock;
+			uint8 *mPtr;
+		};
+	private:
+		Block *mFirst;
+		Block *mCurrent;
+		uint8 *mPtr;
+		uint8 *mEnd;
+		SIZE_T mBlockSize;
+		void nextBlock(SIZE_T aSize);
+	public:
+		Arena(SIZE_T aBlockSize = 64 * 1024);
+		~Arena();
+		void *alloc(SIZE_T aSize, SIZE_T aAlign);
+		template <typename T> T *alloc(int32 aCount)
+		{
+			return (T*)alloc(sizeof(T) * aCount, alignof(T));
+		}
+		void reset();
+		Marker mark() const;
+		void rewind(const Marker &aMarker);
+	};
+
+	// How a branch draws the random value that shapes its fork
+	enum RandomMode
+	{
+		RANDOM_LEGACY, // |cos(x + x^2)| of a float made from seed, level and fork counts, as proctree.js does
+		RANDOM_HASH // SplitMix64 hash of seed, level and the branch's place in its level
+	};
+
 	class Properties
 	{
 	public:
@@ -65,6 +121,8 @@ namespace Proctree
 		float mTaperRate;
 		float mTwistRate;
 		int32 mSegments;
+		float mSegmentFalloff; // ring segments of each level past the trunk relative to the level above, 1 gives every level mSegments
+		int32 mMinSegments; // fewest ring segments mSegmentFalloff goes down to, even and at least 4
 		int32 mLevels;
 		float mSweepAmount;
 		float mInitialBranchLength;
@@ -74,7 +132,17 @@ namespace Proctree
 		float mVMultiplier;
 		float mTwigScale;
 		int32 mSeed;
-		int32 mRseed;
+		RandomMode mRandomMode;
+		bool mAnalyticNormals;
+		int32 mParallelLevel; // branches from this level on are generated on worker threads, -1 keeps everything on the calling thread
+		bool mKeepSkeleton; // generate() also writes the branch array, as generateSkeleton() does
+		bool mTwigs; // give every leaf its twig cards
+		float mPruneOverlap; // drops a branch and its subtree when its bark runs into an earlier branch's; higher values prune more, up to every branch that touches one at 1, 0 keeps every branch
+		float mTwigCullOcclusion; // thins twigs enclosed along all six axes and hidden from this share of the directions out of the crown, 0 keeps every twig
+		bool mOptimizeVertexCache; // generate() reorders the triangles for the post-transform vertex cache and the vertices by first use
+		bool mProgressiveOrder; // bark faces keep their level order through every pass and twigs go from the outside of the crown in, so face list prefixes make coarser trees
+		bool mTwigInstances; // every twig comes out as a TwigInstance of the shared card instead of its own vertices and faces
+		int32 mLevelsDropped; // deepest levels meshed without bark, their twigs stay; the trunk always keeps it and streaming ignores it
 
 		Properties();
 		Properties(
@@ -100,69 +168,532 @@ namespace Proctree
 			float aVMultiplier,
 			float aTwigScale,
 			int32 aSeed);
-		float random(float aFixed);
+		// aFixed of 0 draws from aCounter instead, which then advances
+		float random(float aFixed, int32 &aCounter) const;
+		// Stateless value in [0, 1) for RANDOM_HASH
+		float hashRandom(int32 aLevel, int32 aIndex) const;
+		// Ring segments of the forks of a level
+		int32 levelSegments(int32 aLevel) const;
+	};
+
+
+	// Buffer sizes of a generated tree. They only depend on the level, trunk
+	// step and segment counts, so they are known before generating anything.
+	// Pruning and twig culling can only make the generated tree smaller.
+	struct TreeSize
+	{
+		int32 mBranchCount;
+		int32 mForkCount;
+		int32 mLeafCount;
+		int32 mVertCount; // without the seam duplicates added by fixUVs
+		int32 mSeamVertCount; // upper bound of those duplicates
+		int32 mFaceCount;
+		int32 mTwigVertCount; // twig cards as drawn, instanced or not
+		int32 mTwigFaceCount;
+		int32 mTwigInstanceCount; // 0 unless Properties::mTwigInstances
+
+		SIZE_T getAllocatedSize() const;
 	};
 
+	// What fitBudget() cut from a tree
+	struct BudgetCuts
+	{
+		int32 mSegments; // ring segments taken off every level
+		int32 mLevels; // deepest levels left without bark, added to Properties::mLevelsDropped
+		bool mTwigs; // twig cards dropped
+		bool mFits; // false when even the smallest tree is over budget
+	};
 
-	class Branch
+	// How a LOD of Tree::generateLods() is meshed from the shared skeleton
+	struct LodSettings
+	{
+		int32 mSegmentsCut; // ring segments taken off every level, down to mMinSegments
+		int32 mLevelsDropped; // deepest levels left without bark on top of Properties::mLevelsDropped, the trunk always keeps it
+		float mTwigCullOcclusion; // used instead of Properties::mTwigCullOcclusion when it culls more: nonzero and lower, or that one is 0
+	};
+
+	// Average cache miss ratio of the bark and twig triangles before and after
+	// Properties::mOptimizeVertexCache, in transformed vertices per triangle
+	// through a FIFO cache of VertexCacheReport::CacheSize entries
+	struct VertexCacheReport
+	{
+		static const int32 CacheSize = 16;
+		float mBarkBefore;
+		float mBarkAfter;
+		float mTwigBefore;
+		float mTwigAfter;
+	};
+
+	// One branch of a generated tree. Branches come in skeleton order, so a
+	// parent always precedes its children.
+	struct SkeletonBranch
+	{
+		fvec3 mHead; // end point of the branch
+		fvec3 mParentHead; // start point of the branch, the origin for the root
+		float mRadius; // radius at the start of the branch
+		int32 mParent; // index of the parent branch, -1 for the root
+		int32 mLevel; // 0 for the trunk, mLevels + 1 for leaves
+		bool mTrunk; // part of the trunk chain
+		bool mLeaf; // ends in twigs instead of forking
+		bool mPruned; // dropped by Properties::mPruneOverlap, as is its subtree
+	};
+
+	// Placement of one twig card with Properties::mTwigInstances: the card
+	// of Tree::writeTwigCard() scaled by mScale, rotated by mRotation and
+	// moved to mPosition
+	struct TwigInstance
+	{
+		fvec3 mPosition;
+		float mScale;
+		fvec4 mRotation; // unit quaternion x, y, z, w
+	};
+
+	// Caller-owned output of a tree. Size each buffer from Tree::predictSize();
+	// the vertex buffers also need room for the seam duplicates, that is
+	// mVertCount + mSeamVertCount entries. The counts are written by the
+	// generator.
+	struct TreeBuffers
+	{
+		fvec3 *mVert;
+		fvec3 *mNormal;
+		fvec4 *mTangent;
+		fvec2 *mUV;
+		fvec3 *mTwigVert;
+		fvec3 *mTwigNormal;
+		fvec4 *mTwigTangent;
+		fvec2 *mTwigUV;
+		ivec3 *mFace;
+		ivec3 *mTwigFace;
+		SkeletonBranch *mBranch; // only written with Properties::mKeepSkeleton, mBranchCount entries
+		TwigInstance *mTwigInstances; // only written with Properties::mTwigInstances, which leaves the twig buffers empty
+
+		int32 mVertCount;
+		int32 mTwigVertCount;
+		int32 mFaceCount;
+		int32 mTwigFaceCount;
+		int32 mBranchCount;
+		int32 mTwigInstanceCount;
+	};
+
+	// One piece of a tree streamed by Tree::generate(TreeSink &, int32). The
+	// data points into the generator's scratch and is only valid during the
+	// callback. Vertices are numbered in the order the chunks arrive, so
+	// appending every chunk to one set of buffers gives the indexed mesh;
+	// face indices are already global and may refer to earlier chunks.
+	struct TreeChunk
+	{
+		int32 mVertStart;
+		int32 mVertCount;
+		int32 mFaceStart;
+		int32 mFaceCount;
+		int32 mTwigVertStart;
+		int32 mTwigVertCount;
+		int32 mTwigFaceStart;
+		int32 mTwigFaceCount;
+
+		const fvec3 *mVert;
+		const fvec3 *mNormal;
+		const fvec4 *mTangent;
+		const fvec2 *mUV;
+		const ivec3 *mFace;
+		const fvec3 *mTwigVert;
+		const fvec3 *mTwigNormal;
+		const fvec4 *mTwigTangent;
+		const fvec2 *mTwigUV;
+		const ivec3 *mTwigFace;
+	};
+
+	// Receives the chunks of a streamed tree, in order, on the generating thread
+	class TreeSink
 	{
 	public:
-		Branch *mChild0;
-		Branch *mChild1;
-		Branch *mParent;
-		fvec3 mHead;
-		fvec3 mTangent;
-		float mLength;
-		int32 mTrunktype;
-		int32 *mRing0, *mRing1, *mRing2;
-		int32 *mRootRing;
-		float mRadius;
-		int32 mEnd;
+		virtual ~TreeSink() {}
+		virtual void consume(const TreeChunk &aChunk) = 0;
+	};
 
-		~Branch();
-		Branch();
-		Branch(fvec3 aHead, Branch *aParent);
-		void split(int32 aLevel, int32 aSteps, Properties &aProperties, int32 aL1 = 1, int32 aL2 = 1);
+	// Run of 16-bit indices that count from their own base vertex
+	struct IndexRange
+	{
+		int32 mFirstIndex;
+		int32 mIndexCount;
+		int32 mBaseVertex;
+		int32 mVertexCount; // highest vertex used past mBaseVertex, plus one
+	};
+
+	// Destination of one mesh for Tree::generate(OutputFormat &). Every vertex
+	// stream is a base pointer and a byte stride, so it can point into a split
+	// array or at a field of an interleaved vertex; null streams are skipped.
+	// Vertex streams need room for mVertCount + mSeamVertCount entries of
+	// Tree::predictSize(), the index stream for three entries per face.
+	struct MeshStreams
+	{
+		fvec3 *mPosition;
+		int32 mPositionStride;
+		fvec3 *mNormal;
+		int32 mNormalStride;
+		fvec3 *mTangent;
+		int32 mTangentStride;
+		bool *mTangentFlip; // set where the output bitangent is cross(tangent, normal) rather than cross(normal, tangent)
+		int32 mTangentFlipStride;
+		fvec2 *mUV;
+		int32 mUVStride;
+		uint32 *mIndex;
+
+		// Compact streams. Packed vectors hold x, y and z as signed bytes
+		// scaled by 127 from the low byte up; the normal's fourth byte is -127
+		// where mTangentFlip would be set and 127 elsewhere, the tangent's is 0.
+		// Half UVs hold u in the low and v in the high IEEE half float.
+		uint32 *mPackedNormal;
+		int32 mPackedNormalStride;
+		uint32 *mPackedTangent;
+		int32 mPackedTangentStride;
+		uint32 *mHalfUV;
+		int32 mHalfUVStride;
+		// With mIndex16 set, faces are split into ranges of at most 65536
+		// vertices each and go there instead of mIndex. Where the faces of a
+		// range use vertices too far apart, each range gets its own block of
+		// copies of the vertices it uses, and mVertCount counts the copies;
+		// the branch streams have room for mVertCount + mSeamVertCount of
+		// predictSize() vertices. If the copies run past that, or the ranges
+		// run past mIndexRangeCapacity, the indices go to mIndex after all
+		// and mIndexRangeCount is 0.
+		uint16 *mIndex16;
+		IndexRange *mIndexRanges;
+		int32 mIndexRangeCapacity;
+		int32 mIndexRangeCount; // written by the generator
+
+		int32 mVertCount; // written by the generator
+		int32 mFaceCount;
+		fvec3 mBoundsMin; // written by the generator, min > max for an empty mesh
+		fvec3 mBoundsMax;
+
+		MeshStreams();
+	};
+
+	// Axis convention, unit scale and destinations of a generated tree
+	struct OutputFormat
+	{
+		bool mSwapYZ; // Z-up output; faces keep their corner order
+		float mScale; // applied to positions
+		MeshStreams mBranches;
+		MeshStreams mTwigs;
+		// With Properties::mTwigInstances the twigs go here instead of
+		// mTwigs, whose bounds still cover them
+		TwigInstance *mTwigInstances;
+		int32 mTwigInstanceCount; // written by the generator
+
+		OutputFormat();
+	};
+
+	// Branch skeleton of a tree, stored as one dense array per field. Branches
+	// are laid out level by level: the trunk chain first, then every level 1
+	// branch and so on, with the leaves in the last block. A parent always comes
+	// before its children, so every generation stage is a single forward sweep.
+	// Nothing recurses or keeps a traversal stack, so stack use does not grow
+	// with mLevels and generation is safe on small-stack worker threads.
+	class Skeleton
+	{
+		// Per-level values split() would otherwise recompute for every branch
+		fvec3 *mLevelOffset;
+		float *mRandom;
+		int32 mRandomCount;
+		float *mChildLength; // [level - 1][trunk fork] for fork levels past the trunk
+		int32 mOriginCount;
+		void initLevelTables(const Properties &aProperties, Arena &aArena);
+		float branchRandom(int32 aBranch, const Properties &aProperties);
+		bool extendsTrunk(int32 aBranch, const Properties &aProperties) const;
+		void split(int32 aBranch, int32 aChild0, int32 aChild1, const Properties &aProperties);
+		void flowRadii(const Properties &aProperties);
+	public:
+		int32 mCount;
+		int32 mLevelCount;
+		int32 *mLevelStart; // mLevelCount + 1 entries, the last one is mCount
+		int32 *mLevelVertBase; // first vertex of each level block
+		int32 *mLevelFaceBase; // first face of each level block
+		int32 *mLevelSegments; // ring segments of each level, the parent ring's for leaves
+		int32 *mLevelVertStride; // vertices of every branch of a level
+		int32 *mLevelFaceStride; // faces joining every branch of a level to its parent
+		int32 mTwigOrigin; // leaf whose twig comes first in the twig buffers
+		int32 mRseed; // random() counter, starts at the seed
+
+		fvec3 *mHead;
+		fvec3 *mTangent;
+		float *mLength;
+		float *mRadius;
+		int32 *mTrunktype;
+		int32 *mLevel; // 0 for the trunk, mLevels + 1 for leaves
+		int32 *mSteps;
+		int32 *mL1;
+		int32 *mL2;
+		int32 *mParent; // -1 for the root
+		int32 *mChild0; // -1 for leaves
+		int32 *mChild1;
+		uint8 *mPruned; // set by prune(), null when nothing was pruned
+		uint8 *mTwigCulled; // set by cullTwigs(), null when no twig was culled
+		int32 mBarkLevels; // levels meshed with bark, deeper branches only keep their twigs
+
+		Skeleton();
+		void grow(const Properties &aProperties, Arena &aArena);
+		void prune(const Properties &aProperties, Arena &aArena);
+		void cullTwigs(const Properties &aProperties, Arena &aArena);
+		// Fills the level block tables for the ring segments of aProperties.
+		// grow() lays the branches out once; meshing them again with other
+		// ring segments only needs a new layout.
+		void layout(const Properties &aProperties, Arena &aArena);
+		static int32 levelSize(int32 aLevel, int32 aLevels, int32 aTreeSteps);
+
+		// First fork ring vertex of a branch, or the end vertex of a leaf
+		int32 vertBase(int32 aBranch) const
+		{
+			int32 level = mLevel[aBranch];
+			return mLevelVertBase[level] + (aBranch - mLevelStart[level]) * mLevelVertStride[level];
+		}
+
+		// First face joining a branch to its parent fork
+		int32 faceBase(int32 aBranch) const
+		{
+			int32 level = mLevel[aBranch];
+			return mLevelFaceBase[level] + (aBranch - mLevelStart[level]) * mLevelFaceStride[level];
+		}
+
+		bool pruned(int32 aBranch) const
+		{
+			return mPruned && mPruned[aBranch];
+		}
+
+		// Whether a branch gets no bark, pruned or past mBarkLevels
+		bool barkDropped(int32 aBranch) const
+		{
+			return pruned(aBranch) || mLevel[aBranch] >= mBarkLevels;
+		}
+
+		bool dropsBark() const
+		{
+			return mPruned || mBarkLevels < mLevelCount;
+		}
+
+		// Whether a leaf keeps its twig cards
+		bool hasTwig(int32 aBranch) const
+		{
+			return !pruned(aBranch) && !(mTwigCulled && mTwigCulled[aBranch]);
+		}
+
+		// First twig vertex of a leaf
+		int32 twigBase(int32 aBranch) const
+		{
+			return (aBranch - mTwigOrigin) * 8;
+		}
+	};
+
+
+	// Faces and UV seams of the last tree generated through a context. They
+	// follow from the level, trunk step and segment counts and from where each
+	// branch ring joins its parent's ring, so the next tree with the same
+	// values takes them from here instead of rebuilding them in fixUVs.
+	class TopologyCache
+	{
+	public:
+		int32 mLevels;
+		int32 mTreeSteps;
+		int32 mSegments;
+		float mSegmentFalloff;
+		int32 mMinSegments;
+		int32 mBranchCount; // -1 while nothing is cached
+		int32 mFaceCount;
+		int32 mDuplicateCount;
+		int32 mBranchCapacity;
+		int32 mFaceCapacity;
+		int32 mDuplicateCapacity;
+
+		int32 *mSegOffset; // parent ring entry each branch ring starts at
+		ivec3 *mFace; // faces after the seam fix
+		int32 *mDuplicate; // vertex copied by each seam duplicate, in order
+
+		TopologyCache();
+		~TopologyCache();
+		bool matches(const Properties &aProperties, const int32 *aSegOffset, int32 aBranchCount) const;
+		void reserve(int32 aBranchCount, int32 aFaceCount, int32 aDuplicateCount);
+		void release();
+	};
+
+
+	// Output buffers and scratch memory of a tree generator. The buffers only
+	// ever grow, so once a context has generated the largest tree it is asked
+	// for, further generate() calls do no heap allocations. A context serves
+	// one tree at a time; the output of a tree stays valid until the next
+	// generate() on the same context.
+	class GeneratorContext
+	{
+	public:
+		Arena mArena; // skeleton and per-generate scratch, rewound every run
+		TopologyCache mTopology;
+		int32 mVertCapacity;
+		int32 mTwigVertCapacity;
+		int32 mFaceCapacity;
+		int32 mTwigFaceCapacity;
+		int32 mBranchCapacity;
+
+		fvec3 *mVert;
+		fvec3 *mNormal;
+		fvec4 *mTangent;
+		fvec2 *mUV;
+		fvec3 *mTwigVert;
+		fvec3 *mTwigNormal;
+		fvec4 *mTwigTangent;
+		fvec2 *mTwigUV;
+		ivec3 *mFace;
+		ivec3 *mTwigFace;
+		SkeletonBranch *mBranch;
+		int32 *mLevelFaceEnd;
+		int32 mLevelCapacity;
+		TwigInstance *mTwigInstance;
+		int32 mTwigInstanceCapacity;
+
+		GeneratorContext();
+		~GeneratorContext();
+		void reserve(int32 aVertCount, int32 aTwigVertCount, int32 aFaceCount, int32 aTwigFaceCount);
+		void reserveBranches(int32 aBranchCount);
+		void reserveLevels(int32 aLevelCount);
+		void reserveTwigInstances(int32 aCount);
+		void release();
+
+		// Context of the calling thread, created on first use
+		static GeneratorContext &get();
 	};
 
 
 	class Tree
 	{
-		Branch *mRoot;
+		Skeleton mSkeleton;
+		GeneratorContext mOwnContext;
+		GeneratorContext *mContext;
+		TreeBuffers *mBuffers; // caller buffers of the running generate(), if any
+		int32 mVertCapacity;
+		float **mRingCos; // per level, cosine and sine of every ring segment angle
+		float **mRingSin;
+		float mQuarterCos;
+		float mQuarterSin;
+		int32 *mSegOffset; // per branch, written by doFaces
+		int32 *mSweepStart; // branches of each level the stages work on, the whole level unless streaming
+		int32 *mSweepEnd;
 		void init();
-		void allocVertBuffers();
-		void allocFaceBuffers();
-		void calcVertSizes(Branch *aBranch);
-		void calcFaceSizes(Branch *aBranch);
+		void growSkeleton();
+		void meshSkeleton();
+		void allocBuffers(const TreeSize &aSize);
 		void calcNormals();
-		void doFaces(Branch *aBranch);
-		void createTwigs(Branch *aBranch);
-		void createForks(Branch *aBranch, float aRadius);
+		void doFaces();
+		template <typename Segments> void doBranchFaces(int32 aBranch, Segments aSegments);
+		void stitchRings(int32 aBranch, int32 aSegOffset, int32 aSegments);
+		void capPrunedBranch(int32 aBranch);
+		void dropPrunedFaces();
+		void dropHiddenTwigs();
+		void dropUnusedVerts();
+		void optimizeVertexCache();
+		void orderTwigsByImportance();
+		void createTwigs();
+		void createTwig(int32 aBranch);
+		void createTwigInstance(int32 aBranch);
+		void initRingTables();
+		void createForks();
+		template <typename Segments> void createFork(int32 aBranch, float aRadius, Segments aSegments);
+		void setRingNormal(int32 aVert, fvec3 aCenter);
+		void calcTangents();
+		template <typename Segments> void calcBranchTangents(int32 aBranch, Segments aSegments);
+		void setRingTangent(int32 aVert, int32 aPrev, int32 aNext, fvec3 aAxis);
 		void fixUVs();
+		int32 findSeams(int32 *aSource);
+		void copySeamVerts(const int32 *aSource, int32 aCount);
+		void writeBranches();
+		void sweepLevels(int32 aFirst, int32 aLast);
+		void writeOutput(OutputFormat &aFormat);
+		static void writeStreams(MeshStreams &aStreams, bool aSwapYZ, float aScale, const fvec3 *aVert, const fvec3 *aNormal, const fvec4 *aTangent, const fvec2 *aUV, int32 aVertCount, int32 aVertCapacity, const ivec3 *aFace, int32 aFaceCount, Arena *aScratch);
 	public:
 		Properties mProperties;
 		int32 mVertCount;
 		int32 mTwigVertCount;
 		int32 mFaceCount;
 		int32 mTwigFaceCount;
+		int32 mBranchCount;
 
 		fvec3 *mVert;
 		fvec3 *mNormal;
+		fvec4 *mTangent; // U direction, w is the sign of the V direction along cross(normal, tangent)
 		fvec2 *mUV;
 		fvec3 *mTwigVert;
 		fvec3 *mTwigNormal;
+		fvec4 *mTwigTangent;
 		fvec2 *mTwigUV;
 		ivec3 *mFace;
 		ivec3 *mTwigFace;
+		SkeletonBranch *mBranch;
+		// Bark faces come level by level, trunk first and the leaf tips
+		// last; the faces of levels 0 to i end at mLevelFaceEnd[i]. Only
+		// mProgressiveOrder keeps that order with mOptimizeVertexCache.
+		int32 *mLevelFaceEnd;
+		int32 mFaceLevelCount;
+		// With mProperties.mTwigInstances the twigs are only these, in the
+		// context or in TreeBuffers::mTwigInstances like the buffers
+		TwigInstance *mTwigInstance;
+		int32 mTwigInstanceCount;
+		VertexCacheReport mCacheReport; // written by generate() when mOptimizeVertexCache is set
 
 		Tree();
-		~Tree();
+		// Generates into a shared context instead of the tree's own one
+		Tree(GeneratorContext &aContext);
 		void generate();
+		// Writes the tree into caller-owned buffers instead of the context
+		void generate(TreeBuffers &aBuffers);
+		// Converts the tree into the format's axis convention and scale while
+		// writing it to the format's streams, and fills in their bounds
+		void generate(OutputFormat &aFormat);
+		// Grows the branches once and meshes them aLodCount times, LOD i
+		// with aLods[i] into aFormats[i]. The stream counts tell the LODs
+		// apart; the tree's own outputs are those of the last one and
+		// mCacheReport that of the first.
+		void generateLods(OutputFormat *aFormats, const LodSettings *aLods, int32 aLodCount);
+		// Cuts mProperties down to the budget as fitBudget() does, growing
+		// the branches once and meshing them for each cut it tries
+		BudgetCuts fitBudget(int32 aMaxTriangles, int32 aMaxVertices);
+		// Hands the tree to aSink piece by piece: first the part above the
+		// chunk level, then runs of whole subtrees of at most about
+		// aChunkBranches branches each. Scratch memory stays at the size of
+		// the upper part plus one chunk, however big the tree is. Branches are
+		// not pruned or reordered for the vertex cache here, chunks rely on
+		// the full level blocks; twigs are still culled, and stay cards.
+		void generate(TreeSink &aSink, int32 aChunkBranches);
+		// Grows the branches and writes only mBranch, without any meshing
+		void generateSkeleton();
+		static TreeSize predictSize(const Properties &aProperties);
+		// Writes the card every TwigInstance places, 8 vertices and 4 faces
+		// in card units, for instances written with aSwapYZ
+		static void writeTwigCard(MeshStreams &aStreams, bool aSwapYZ);
 	};
 
 
-	fvec3 mirrorBranch(fvec3 aVec, fvec3 aNorm, Properties &aProperties);
+	// Generates aCount trees spread over worker threads, tree i from
+	// aProperties[i] into aBuffers[i]. The largest trees are started first so
+	// the threads run out of work together. Each tree runs on a single thread
+	// with that thread's GeneratorContext, mParallelLevel is ignored.
+	void generateBatch(const Properties *aProperties, TreeBuffers *aBuffers, int32 aCount);
+
+	// Shrinks aProperties until the tree has at most aMaxTriangles triangles
+	// and aMaxVertices vertices, bark and twigs together; 0 leaves a limit
+	// open. The cuts keep the grown branches and are measured on the meshes
+	// they give, seam duplicates, pruning and culling included, so the tree
+	// keeps as much as the budget allows. They come in a fixed order: ring
+	// segments down to mMinSegments first, then the bark of the deepest
+	// levels through mLevelsDropped, then the twigs, each taken only as far
+	// as the budget needs. Runs on the calling thread's GeneratorContext.
+	BudgetCuts fitBudget(Properties &aProperties, int32 aMaxTriangles, int32 aMaxVertices);
+
+	// Vertices transformed per triangle when aFace goes through a FIFO
+	// post-transform cache of aCacheSize entries; 3 means no reuse at all
+	float cacheMissRatio(const ivec3 *aFace, int32 aFaceCount, int32 aVertCount, int32 aCacheSize);
+
+
+	fvec3 mirrorBranch(fvec3 aVec, fvec3 aNorm, const Properties &aProperties);
 	fvec3 axisAngle(fvec3 aVec, fvec3 aAxis, float aAngle);
+	fvec3 axisRotate(fvec3 aVec, fvec3 aAxis, float aCos, float aSin);
 	fvec3 scaleInDirection(fvec3 aVector, fvec3 aDirection, float aScale);
 	fvec3 scaleVec(fvec3 a, float b);
 	fvec3 add(fvec3 a, fvec3 b);
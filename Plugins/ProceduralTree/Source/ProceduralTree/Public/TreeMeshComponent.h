@@ -7,11 +7,54 @@
 #include "UObject/ObjectMacros.h"
 #include "Interfaces/Interface_CollisionDataProvider.h"
 #include "Components/MeshComponent.h"
+#include "PackedNormal.h"
 #include "TreeMeshComponent.generated.h"
 
 class FPrimitiveSceneProxy;
 
 
+/** Random number source of the tree generator */
+UENUM()
+enum class EProcTreeRandomMode : uint8
+{
+	/** The original proctree.js generator; nearby large seeds give similar trees */
+	Legacy,
+	/** Stateless hash of seed, level and branch, every seed gives a distinct tree */
+	Hash UMETA(DisplayName = "Counter hash")
+};
+
+
+/** A coarser LOD meshed from the same branches as the full detail tree */
+USTRUCT()
+struct FProcTreeLod
+{
+	GENERATED_USTRUCT_BODY()
+
+	/** Screen size below which this LOD is drawn */
+	UPROPERTY(EditAnywhere, DisplayName = "Screen size", Category = "Tree LOD", meta = (ClampMin = "0.0", ClampMax = "2.0", UIMin = "0.0", UIMax = "2.0"))
+		float ScreenSize;
+
+	/** Half ring segments taken off every branch level, down to the min branch half segments */
+	UPROPERTY(EditAnywhere, DisplayName = "Half segments cut", Category = "Tree LOD", meta = (ClampMin = "0", ClampMax = "16", UIMin = "0", UIMax = "16"))
+		int32 HalfSegmentsCut;
+
+	/** Deepest branch levels drawn without bark; their twigs stay */
+	UPROPERTY(EditAnywhere, DisplayName = "Levels dropped", Category = "Tree LOD", meta = (ClampMin = "0", ClampMax = "10", UIMin = "0", UIMax = "10"))
+		int32 LevelsDropped;
+
+	/** Twig cull occlusion of this LOD, used when it thins more than the tree's: lower than it, or the tree's is 0. 0 keeps the tree's twigs */
+	UPROPERTY(EditAnywhere, DisplayName = "Twig cull occlusion", Category = "Tree LOD", meta = (ClampMin = "0.0", ClampMax = "1.0", UIMin = "0.0", UIMax = "1.0"))
+		float TwigCullOcclusion;
+
+	FProcTreeLod()
+	{
+		ScreenSize = 0.25f;
+		HalfSegmentsCut = 1;
+		LevelsDropped = 1;
+		TwigCullOcclusion = 0.2f;
+	}
+};
+
 
 USTRUCT(meta = (ShowOnlyInnerProperties))
 struct PROCEDURALTREE_API FProcTreeGenProperties
@@ -30,6 +73,14 @@ public:
 	UPROPERTY(EditAnywhere, DisplayName = "Branch Half Segments", Category = General, meta = (ClampMin = "1", ClampMax = "16", UIMin = "1", UIMax = "16"))
 		int32 HalfSegments;
 
+	/** Branch segments of each level relative to the level above. Around the radius falloff rate keeps thin branches about as finely cut as the trunk; 1 gives every level the full count */
+	UPROPERTY(EditAnywhere, DisplayName = "Segment falloff", Category = General, meta = (ClampMin = "0.1", ClampMax = "1.0", UIMin = "0.1", UIMax = "1.0"))
+		float SegmentFalloff;
+
+	/** Fewest half segments the segment falloff goes down to */
+	UPROPERTY(EditAnywhere, DisplayName = "Min branch half segments", Category = General, meta = (ClampMin = "2", ClampMax = "16", UIMin = "2", UIMax = "16"))
+		int32 MinHalfSegments;
+
 	UPROPERTY(EditAnywhere, DisplayName = "Branch levels", Category = General, meta = (ClampMin = "1", ClampMax = "10", UIMin = "1", UIMax = "10"))
 		int32 Levels;
 
@@ -42,6 +93,54 @@ public:
 	UPROPERTY(EditAnywhere, DisplayName = "Twig scale", Category = General, meta = (ClampMin = "0.05", ClampMax = "2.0", UIMin = "0.05", UIMax = "2.0"))
 		float TwigScale;
 
+	/** Thins twigs inside the crown that are hidden from at least this share of the directions out of it. Twigs with open space along any axis are kept, so the outline holds to about a twig card; 0 keeps every twig */
+	UPROPERTY(EditAnywhere, DisplayName = "Twig cull occlusion", Category = General, meta = (ClampMin = "0.0", ClampMax = "1.0", UIMin = "0.0", UIMax = "1.0"))
+		float TwigCullOcclusion;
+
+	/** Changing the mode changes every tree; keep Legacy for trees that are already placed */
+	UPROPERTY(EditAnywhere, DisplayName = "Random mode", Category = General)
+		EProcTreeRandomMode RandomMode;
+
+	/** Take bark normals straight from the branch rings instead of averaging the faces around each vertex */
+	UPROPERTY(EditAnywhere, DisplayName = "Analytic normals", Category = General)
+		bool bAnalyticNormals;
+
+	/** Reorder the triangles of both sections for the post-transform vertex cache and their vertices by first use; see the vertex cache report */
+	UPROPERTY(EditAnywhere, DisplayName = "Optimize vertex cache", Category = General)
+		bool bOptimizeVertexCache;
+
+	/** Keep one position, rotation and scale per twig and a single card that every twig copies, instead of the card's vertices for each twig. Instanced twigs have no collision */
+	UPROPERTY(EditAnywhere, DisplayName = "Instanced twigs", Category = General)
+		bool bInstancedTwigs;
+
+	/** Keep and render the sections with 8-bit normals and tangents, half precision UVs and 16-bit indices; a section whose triangles do not fit in 16-bit ranges keeps 32-bit indices */
+	UPROPERTY(EditAnywhere, DisplayName = "Compact formats", Category = General)
+		bool bCompactFormats;
+
+	/** Order the faces so that a distant tree draws a prefix of them: bark level by level, twigs from the outside of the crown in. Not used with LODs */
+	UPROPERTY(EditAnywhere, DisplayName = "Progressive LOD", Category = "Tree LOD")
+		bool bProgressiveLod;
+
+	/** Screen size at and above which the whole tree is drawn. Every halving of the screen size below it drops the deepest branch level left and half the twigs */
+	UPROPERTY(EditAnywhere, DisplayName = "Full detail screen size", Category = "Tree LOD", meta = (ClampMin = "0.01", ClampMax = "2.0", UIMin = "0.01", UIMax = "2.0", EditCondition = "bProgressiveLod"))
+		float FullDetailScreenSize;
+
+	/** Coarser LODs, nearest first. The branches are grown once and meshed again for each of them */
+	UPROPERTY(EditAnywhere, DisplayName = "LODs", Category = "Tree LOD")
+		TArray<FProcTreeLod> Lods;
+
+	/** Share of a LOD's screen size the switch point moves away from the LOD being drawn, so a tree near the switch distance does not flicker between two LODs */
+	UPROPERTY(EditAnywhere, DisplayName = "LOD hysteresis", Category = "Tree LOD", meta = (ClampMin = "0.0", ClampMax = "0.5", UIMin = "0.0", UIMax = "0.5"))
+		float LodHysteresis;
+
+	/** Most triangles the tree may have, bark and twigs together; 0 for no limit. Segments are cut first, then the bark of the deepest levels, then the twigs */
+	UPROPERTY(EditAnywhere, DisplayName = "Max triangles", Category = Budget, meta = (ClampMin = "0", UIMin = "0"))
+		int32 MaxTriangles;
+
+	/** Most vertices the tree may have, bark and twigs together; 0 for no limit */
+	UPROPERTY(EditAnywhere, DisplayName = "Max vertices", Category = Budget, meta = (ClampMin = "0", UIMin = "0"))
+		int32 MaxVertices;
+
 	UPROPERTY(EditAnywhere, DisplayName = "Initial length", Category = Branching, meta = (ClampMin = "0.05", ClampMax = "5.0", UIMin = "0.05", UIMax = "5.0"))
 		float InitialBranchLength;
 
@@ -69,6 +168,10 @@ public:
 	UPROPERTY(EditAnywhere, DisplayName = "Sweep", Category = Branching, meta = (ClampMin = "-1.0", ClampMax = "1.0", UIMin = "-1.0", UIMax = "1.0"))
 		float SweepAmount;
 
+	/** Drops branches, with everything growing from them, once their bark runs into an earlier branch's. Higher values prune more: near 0 only branches buried deep in another go, 1 drops every branch that touches one; 0 keeps every branch */
+	UPROPERTY(EditAnywhere, DisplayName = "Prune overlap", Category = Branching, meta = (ClampMin = "0.0", ClampMax = "1.0", UIMin = "0.0", UIMax = "1.0"))
+		float PruneOverlap;
+
 	UPROPERTY(EditAnywhere, DisplayName = "Trunk radius", Category = Trunk, meta = (ClampMin = "0.05", ClampMax = "0.5", UIMin = "0.05", UIMax = "0.5"))
 		float MaxRadius;
 
@@ -116,6 +219,8 @@ public:
 	{
 		Seed = aSeed;
 		HalfSegments = aSegments;
+		SegmentFalloff = 1.0f;
+		MinHalfSegments = 2;
 		Levels = aLevels;
 		VMultiplier = aVMultiplier;
 		TwigScale = aTwigScale;
@@ -136,12 +241,26 @@ public:
 		RadiusFalloffRate = aRadiusFalloffRate;
 		TwistRate = aTwistRate;
 		TrunkLength = aTrunkLength;
+		RandomMode = EProcTreeRandomMode::Legacy;
+		bAnalyticNormals = false;
+		bOptimizeVertexCache = false;
+		bCompactFormats = false;
+		bInstancedTwigs = false;
+		bProgressiveLod = false;
+		FullDetailScreenSize = 0.5f;
+		LodHysteresis = 0.1f;
+		MaxTriangles = 0;
+		MaxVertices = 0;
+		PruneOverlap = 0.0f;
+		TwigCullOcclusion = 0.0f;
 	}
 
 	FProcTreeGenProperties()
 	{
 		Seed = 262;
 		HalfSegments = 6;
+		SegmentFalloff = 1.0f;
+		MinHalfSegments = 2;
 		Levels = 5;
 		VMultiplier = 0.36f;
 		TwigScale = 0.39f;
@@ -162,10 +281,131 @@ public:
 		RadiusFalloffRate = 0.73f;
 		TwistRate = 3.02f;
 		TrunkLength = 2.4f;
+		RandomMode = EProcTreeRandomMode::Legacy;
+		bAnalyticNormals = false;
+		bOptimizeVertexCache = false;
+		bCompactFormats = false;
+		bInstancedTwigs = false;
+		bProgressiveLod = false;
+		FullDetailScreenSize = 0.5f;
+		LodHysteresis = 0.1f;
+		MaxTriangles = 0;
+		MaxVertices = 0;
+		PruneOverlap = 0.0f;
+		TwigCullOcclusion = 0.0f;
+	}
+};
+
+/** What the triangle and vertex budgets cut from the last generated tree */
+USTRUCT()
+struct FProcTreeBudgetReport
+{
+	GENERATED_USTRUCT_BODY()
+
+	UPROPERTY(VisibleAnywhere, DisplayName = "Half segments cut", Category = Budget)
+		int32 HalfSegmentsCut;
+
+	/** Deepest levels drawn without bark, on top of those each LOD drops; their twigs stay */
+	UPROPERTY(VisibleAnywhere, DisplayName = "Levels cut", Category = Budget)
+		int32 LevelsCut;
+
+	UPROPERTY(VisibleAnywhere, DisplayName = "Twigs dropped", Category = Budget)
+		bool bTwigsDropped;
+
+	/** False when even the smallest tree the budget cuts allow is over budget */
+	UPROPERTY(VisibleAnywhere, DisplayName = "Within budget", Category = Budget)
+		bool bWithinBudget;
+
+	FProcTreeBudgetReport()
+	{
+		HalfSegmentsCut = 0;
+		LevelsCut = 0;
+		bTwigsDropped = false;
+		bWithinBudget = true;
+	}
+};
+
+
+/** Average cache miss ratio of the last generated tree, in vertices transformed per triangle; filled when the vertex cache is optimized */
+USTRUCT()
+struct FProcTreeVertexCacheReport
+{
+	GENERATED_USTRUCT_BODY()
+
+	UPROPERTY(VisibleAnywhere, DisplayName = "Bark ACMR before", Category = VertexCache)
+		float BarkAcmrBefore;
+
+	UPROPERTY(VisibleAnywhere, DisplayName = "Bark ACMR after", Category = VertexCache)
+		float BarkAcmrAfter;
+
+	UPROPERTY(VisibleAnywhere, DisplayName = "Twig ACMR before", Category = VertexCache)
+		float TwigAcmrBefore;
+
+	UPROPERTY(VisibleAnywhere, DisplayName = "Twig ACMR after", Category = VertexCache)
+		float TwigAcmrAfter;
+
+	FProcTreeVertexCacheReport()
+	{
+		BarkAcmrBefore = 0.0f;
+		BarkAcmrAfter = 0.0f;
+		TwigAcmrBefore = 0.0f;
+		TwigAcmrAfter = 0.0f;
 	}
 };
 
 
+/** Run of 16-bit indices that count from their own base vertex */
+USTRUCT()
+struct FProcTreeIndexRange
+{
+	GENERATED_USTRUCT_BODY()
+
+	UPROPERTY()
+		int32 FirstIndex;
+
+	UPROPERTY()
+		int32 NumIndices;
+
+	UPROPERTY()
+		int32 BaseVertex;
+
+	/** Highest vertex used past BaseVertex, plus one */
+	UPROPERTY()
+		int32 NumVertices;
+
+	FProcTreeIndexRange()
+		: FirstIndex(0)
+		, NumIndices(0)
+		, BaseVertex(0)
+		, NumVertices(0)
+	{}
+};
+
+
+/** Placement of one copy of a twig section's card */
+USTRUCT()
+struct FProcTreeTwigInstance
+{
+	GENERATED_USTRUCT_BODY()
+
+	UPROPERTY()
+		FVector Position;
+
+	/** Card units to local units */
+	UPROPERTY()
+		float Scale;
+
+	UPROPERTY()
+		FQuat Rotation;
+
+	FProcTreeTwigInstance()
+		: Position(0.f, 0.f, 0.f)
+		, Scale(1.f)
+		, Rotation(FQuat::Identity)
+	{}
+};
+
+
 /**
 *	Struct used to specify a tangent vector for a vertex
 *	The Y tangent is computed from the cross product of the vertex normal (Tangent Z) and the TangentX member.
@@ -221,10 +461,34 @@ struct FProcTreeMeshSection
 	UPROPERTY()
 		TArray<FVector2D> TextureCoordinates0;
 
-	/** Index buffer for this section */
+	/** Index buffer for this section, empty when IndexRanges are used */
 	UPROPERTY()
 		TArray<uint32> IndexBuffer;
 
+	/** Compact normal with the bitangent sign in W, used instead of Normals and Tangents */
+	TArray<FPackedNormal> PackedNormals;
+
+	/** Compact tangent, used instead of Normals and Tangents */
+	TArray<FPackedNormal> PackedTangents;
+
+	/** Compact texture co-ordinate, used instead of TextureCoordinates0 */
+	TArray<FVector2DHalf> HalfTextureCoordinates0;
+
+	/** Compact index buffer, split into IndexRanges */
+	UPROPERTY()
+		TArray<uint16> IndexBuffer16;
+
+	UPROPERTY()
+		TArray<FProcTreeIndexRange> IndexRanges;
+
+	/** With progressive LOD, the faces of branch levels 0 to i end at LevelFaceEnds[i]; empty for twigs */
+	UPROPERTY()
+		TArray<int32> LevelFaceEnds;
+
+	/** With instanced twigs, where the section's mesh, a single card, is drawn; empty otherwise */
+	UPROPERTY()
+		TArray<FProcTreeTwigInstance> TwigInstances;
+
 	/** Local bounding box of section */
 	UPROPERTY()
 		FBox SectionLocalBox;
@@ -251,10 +515,60 @@ struct FProcTreeMeshSection
 		Tangents.Reset();
 		TextureCoordinates0.Reset();
 		IndexBuffer.Reset();
+		PackedNormals.Reset();
+		PackedTangents.Reset();
+		HalfTextureCoordinates0.Reset();
+		IndexBuffer16.Reset();
+		IndexRanges.Reset();
+		LevelFaceEnds.Reset();
+		TwigInstances.Reset();
 		SectionLocalBox.Init();
 		bEnableCollision = false;
 		bSectionVisible = true;
 	}
+
+	/** Number of indices, whichever index buffer holds them */
+	int32 GetNumIndices() const
+	{
+		return IndexRanges.Num() > 0 ? IndexBuffer16.Num() : IndexBuffer.Num();
+	}
+
+	/** Vertex an index refers to, whichever index buffer holds it */
+	uint32 GetIndex(int32 Index) const
+	{
+		for (const FProcTreeIndexRange& Range : IndexRanges)
+		{
+			if (Index < Range.FirstIndex + Range.NumIndices)
+			{
+				return IndexBuffer16[Index] + Range.BaseVertex;
+			}
+		}
+		return IndexBuffer[Index];
+	}
+
+	/** Texture co-ordinate of a vertex, whichever format holds it */
+	FVector2D GetTextureCoordinate(int32 VertIdx) const
+	{
+		return HalfTextureCoordinates0.Num() > 0 ? FVector2D(HalfTextureCoordinates0[VertIdx]) : TextureCoordinates0[VertIdx];
+	}
+
+	/** Normal of a vertex, whichever format holds it */
+	FVector GetNormal(int32 VertIdx) const
+	{
+		return PackedNormals.Num() > 0 ? PackedNormals[VertIdx].ToFVector() : Normals[VertIdx];
+	}
+
+	/** X tangent of a vertex, whichever format holds it */
+	FVector GetTangentX(int32 VertIdx) const
+	{
+		return PackedTangents.Num() > 0 ? PackedTangents[VertIdx].ToFVector() : Tangents[VertIdx].TangentX;
+	}
+
+	/** Whether the Y tangent of a vertex is flipped, whichever format holds it */
+	bool GetFlipTangentY(int32 VertIdx) const
+	{
+		return PackedNormals.Num() > 0 ? PackedNormals[VertIdx].Vector.W < 0 : Tangents[VertIdx].bFlipTangentY;
+	}
 };
 
 
@@ -267,6 +581,10 @@ class PROCEDURALTREE_API UProceduralTreeComponent : public UMeshComponent, publi
 		UPROPERTY()
 		TArray<FProcTreeMeshSection> TreeMeshSections;
 
+		/** Sections of the coarser LODs, bark and twigs of Props.Lods[i] at 2 * i and 2 * i + 1 */
+		UPROPERTY()
+		TArray<FProcTreeMeshSection> LodSections;
+
 
 public:
 
@@ -276,8 +594,17 @@ public:
 	UPROPERTY(EditAnywhere, Category = ProceduralTree, meta = (ShowOnlyInnerProperties))
 		FProcTreeGenProperties Props;
 
+	UPROPERTY(VisibleAnywhere, Transient, Category = Budget)
+		FProcTreeBudgetReport BudgetReport;
+
+	UPROPERTY(VisibleAnywhere, Transient, Category = VertexCache)
+		FProcTreeVertexCacheReport VertexCacheReport;
+
 	void GenerateTreeMesh();
 
+	/** Places a copy of a section's card at each of its twig instances, keeping the section's formats */
+	static void ExpandTwigInstances(const FProcTreeMeshSection& Card, FProcTreeMeshSection& Expanded);
+
 
 #if WITH_EDITOR
 	virtual void PostEditChangeProperty(FPropertyChangedEvent& PropertyChangedEvent) override;
@@ -127,28 +127,35 @@ FReply FTreeMeshComponentDetails::ClickedOnConvertToStaticMesh()
 			{
 				FProcTreeMeshSection* ProcSection = &TreeMeshComp->TreeMeshSections[SectionIdx];
 
+				// Instanced twigs export a copy of the card per instance
+				FProcTreeMeshSection ExpandedSection;
+				if (ProcSection->TwigInstances.Num() > 0)
+				{
+					UProceduralTreeComponent::ExpandTwigInstances(*ProcSection, ExpandedSection);
+					ProcSection = &ExpandedSection;
+				}
+
 				// Copy verts
 				for (FVector& Vert : ProcSection->Vertices)
 				{
 					RawMesh.VertexPositions.Add(Vert);
 				}
 
-				// Copy 'wedge' info
-				int32 NumIndices = ProcSection->IndexBuffer.Num();
-				int32 NumVerts = ProcSection->Vertices.Num();
+				// Copy 'wedge' info, read through the section so compact formats export too
+				int32 NumIndices = ProcSection->GetNumIndices();
 
 
 				for (int32 IndexIdx = 0; IndexIdx < NumIndices; IndexIdx++)
 				{
-					int32 Index = ProcSection->IndexBuffer[IndexIdx];
+					int32 Index = ProcSection->GetIndex(IndexIdx);
 
 					RawMesh.WedgeIndices.Add(Index + VertexBase);
 
 
-					const FVector TangentX = (ProcSection->Tangents.Num() == NumVerts) ? ProcSection->Tangents[Index].TangentX : FVector::ForwardVector;
-					const FVector TangentZ = (ProcSection->Normals.Num() == NumVerts) ? ProcSection->Normals[Index] : FVector::UpVector;
-					const FVector TangentY = (ProcSection->Tangents.Num() == NumVerts) ? (TangentX ^ TangentZ).GetSafeNormal() * (ProcSection->Tangents[Index].bFlipTangentY ? -1.f : 1.f) : FVector::RightVector;
-					const FVector2D UV0 = (ProcSection->TextureCoordinates0.Num() == NumVerts) ? ProcSection->TextureCoordinates0[Index] : FVector2D::ZeroVector;
+					const FVector TangentX = ProcSection->GetTangentX(Index);
+					const FVector TangentZ = ProcSection->GetNormal(Index);
+					const FVector TangentY = (TangentX ^ TangentZ).GetSafeNormal() * (ProcSection->GetFlipTangentY(Index) ? -1.f : 1.f);
+					const FVector2D UV0 = ProcSection->GetTextureCoordinate(Index);
 
 
 					RawMesh.WedgeTangentX.Add(TangentX);